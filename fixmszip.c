@@ -1,7 +1,10 @@
 /* fixmszip.c.  Simple program to fix large zip files created on
  * Windows so that mac/unix zip utilities play nicely with them.
  * This involves changing the "Total Number of disks" field in the Zip64
- * End Of Central Directory Locator structure from "0" to "1"
+ * End Of Central Directory Locator structure from "0" to "1".
+ * Optionally it also checks the central directory, adds missing Zip64 end
+ * records, repairs sizes, offsets and data descriptors written by tools
+ * which don't know about Zip64, renames entries and strips extra fields.
  * Use is entirely at user's own risk
  * Copyright Keith Young 2021
  * For copying information, see the file COPYING distributed with this file
@@ -15,57 +18,2667 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <limits.h>
+#include <time.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>                   /* Only needed for -s */
+#endif
+
+/* Nanosecond file times are in st_mtimespec and st_ctimespec on macOS */
+#ifdef __APPLE__
+#define ST_MTIM st_mtimespec
+#define ST_CTIM st_ctimespec
+#else
+#define ST_MTIM st_mtim
+#define ST_CTIM st_ctim
+#endif
 
 #define EOCDR_BASE_SIZE 22          /* End of Central Directory record size */
 #define Z64_EOCDL_SIZE 20           /* Zip64 EOCD Locator */
 #define Z64_EOCDL_SIG 0x07064b50    /* Zip64 EOCDL signature */
 #define SIG_LEN 4                   /* Zip64 signature length */
+#define EOCDR_SIG 0x06054b50        /* EOCDR signature */
+#define Z64_EOCDR_SIZE 56           /* Zip64 EOCDR size (no extensible data) */
+#define Z64_EOCDR_SIG 0x06064b50    /* Zip64 EOCDR signature */
+#define CD_SIG 0x02014b50           /* Central directory header signature */
+#define MAX_COMMENT 65535           /* Maximum zip file comment length */
+#define TAIL_WINDOW (EOCDR_BASE_SIZE + MAX_COMMENT + Z64_EOCDL_SIZE)
+#define TRAILER_MAX (Z64_EOCDR_SIZE + Z64_EOCDL_SIZE + EOCDR_BASE_SIZE + \
+        MAX_COMMENT)                /* Largest trailer we write */
+#define COPY_CHUNK (1 << 20)        /* Buffer size for copying within a file */
+#define CD_BASE_SIZE 46             /* Central directory header fixed size */
+#define CD_WINDOW (1 << 20)         /* Central directory read window size */
+#define CD_MAX_ENTRY (CD_BASE_SIZE + 3 * 0xffff)    /* Largest CD entry */
+#define Z64_EXTRA_ID 0x0001         /* Zip64 extended information extra id */
+#define UPATH_EXTRA_ID 0x7075       /* Info-ZIP Unicode Path extra id */
+#define PAD_EXTRA_ID 0xd935         /* Padding extra id (as used by zipalign) */
+#define RENAME_MAX 64               /* Maximum number of rename rules */
+#define KEEP_MAX 64                 /* Maximum extra field ids to keep */
+#define LH_SIG 0x04034b50           /* Local file header signature */
+#define LH_BASE_SIZE 30             /* Local file header fixed size */
+#define FLAG_DESCRIPTOR 0x0008      /* Entry is followed by a data descriptor */
+#define METHOD_STORED 0
+#define METHOD_DEFLATED 8
+#define DD_SIG 0x08074b50           /* Data descriptor signature */
+#define DD_MAX 24                   /* Largest data descriptor */
+#define DD_COALESCE 65536           /* Read entries this small in one go */
+#define WRAP 0x100000000LL          /* Where 32 bit sizes and offsets wrap */
+#define RUN_MAX (1 << 20)           /* Extents sorted in memory per run */
+#define RUN_BUF 256                 /* Extents read at a time when merging */
+
+/* Flags for fixup() */
+#define FIX_DRYRUN 0x01             /* Don't change anything */
+#define FIX_GARBAGE 0x02            /* Allow bytes after the EOCDR */
+#define FIX_TRUNCATE 0x04           /* ...and truncate them */
+#define FIX_FOLD 0x08               /* ...or make them part of the comment */
+#define FIX_KEEPDEAD 0x10           /* Leave replaced central dirs in place */
 #define ERRMAX 1024                 /* Maximum error message size */
+#define SEEN_MAX 64                 /* Files remembered by the seen cache */
+#define TRACE_MAX 65536             /* Spans kept for -T */
+#define STATE_HEADER "fixmszip state 1\n" /* First line of a state file */
+
+static char *progname = "fixmszip";
+static int little_endian;           /* This system's endianness. 1 == litle */
+
+/* Rules for renaming entries with fixnames(): a prefix and what to
+   replace it with.  The first matching rule is used */
+struct rename_rule {
+    const char *from;
+    size_t from_len;
+    const char *to;
+    size_t to_len;
+};
+
+static struct rename_rule rename_rules[RENAME_MAX];
+static int nrename_rules;
+static int rename_backslashes;      /* Turn backslashes in names to slashes */
+
+/* Name of the entry findentry() looks for */
+static char *lookup_name;
+
+/* Extra field ids which fixextras() keeps in the central directory */
+static unsigned short keep_extras[KEEP_MAX];
+static int nkeep_extras;
+
+/* A file already examined during this run.  Files are identified by
+   device, inode, size and modification/change times, so the same file
+   named twice on the command line (or reached through a hard link) is only
+   examined once, but a file which has changed since (e.g. because we fixed
+   it) is examined again */
+struct seen_file {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    long long mtime;                /* In nanoseconds */
+    long long ctime;
+    unsigned long used;             /* "time" of last use, for eviction */
+    int res;                        /* Return value from fixup() */
+    char *msg;                      /* Message from fixup() */
+};
+
+static struct seen_file seen[SEEN_MAX];
+static unsigned nseen;
+static unsigned long seen_clock, seen_hits, seen_misses;
+
+/* A file examined during an earlier run, from the state file given with
+   -S.  Identified as for the seen cache, and only matched if examined
+   with the same fixup() flags */
+struct state_file {
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime;                /* In nanoseconds, as a file could */
+    long long ctime;                /* change again in the same second */
+    int flags;                      /* fixup() flags used */
+    int res;                        /* Return value from fixup() */
+    char *msg;                      /* Message from fixup() */
+    size_t seq;                     /* Order added, the last one is kept */
+};
+
+static struct state_file *states;   /* Sorted by dev and inode up to nsorted */
+static size_t nstates, nsorted, maxstates;
+static unsigned long state_hits;
+
+/* A timed span of work on one file, for the trace written with -T */
+struct trace_span {
+    const char *name;               /* What was being done */
+    char *file;                     /* File name, for whole-file spans */
+    unsigned long long fileno;      /* Which file, counting from 0 */
+    long long start,dur;            /* Microseconds */
+};
+
+static char *trace_path;
+static struct trace_span *trace_spans;
+static size_t ntrace;
+static unsigned long long trace_fileno;  /* File being worked on */
+static unsigned long long trace_every = 1;  /* Sampling interval, in files */
+
+/* Print usage an exit */
+void usage()
+{
+    fprintf(stderr,"Usage: %s [-vngtfpczsodbxl@] [-r old=new] [-k ids] [-e name] [-S statefile] [-T tracefile] zipfile [...] | -@\n",progname);
+    exit(1);
+}
+
+/* Return 2 little endian bytes as an unsigned short */
+unsigned short get2bytes(const unsigned char* ptr)
+{
+    if (little_endian) {
+        return((*(ptr+1) <<8) + *ptr);
+    }
+
+    return((*ptr <<8) + *(ptr+1));
+}
+
+/* Return 4 little endian bytes as an unsigned int */
+unsigned int get4bytes(const unsigned char *ptr)
+{
+    int i;
+    unsigned int val=0;
+
+    if (little_endian) {
+        for (i = 0; i < 4; i++) {
+            val += *ptr++ <<(8 * i);
+        }
+    } else {
+        for (i = 0; i < 4; i++) {
+            val += *ptr++ <<(8* (3-i));
+        }
+    }
+    return val;
+}
+
+/* Return 8 little endian bytes as an unsigned long long */
+unsigned long long get8bytes(const unsigned char *ptr)
+{
+    if (little_endian) {
+        return(((unsigned long long) get4bytes(ptr+4) << 32) + get4bytes(ptr));
+    }
+    return(((unsigned long long) get4bytes(ptr) << 32) + get4bytes(ptr+4));
+}
+
+/* Store an unsigned short as 2 little endian bytes */
+void put2bytes(unsigned char *ptr, unsigned short val)
+{
+    if (little_endian) {
+        *ptr = val & 0xff;
+        *(ptr+1) = val >> 8;
+    } else {
+        *ptr = val >> 8;
+        *(ptr+1) = val & 0xff;
+    }
+}
+
+/* Store an unsigned int as 4 little endian bytes */
+void put4bytes(unsigned char *ptr, unsigned int val)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        *ptr++ = (val >> (8 * (little_endian ? i : 3-i))) & 0xff;
+    }
+}
+
+/* Store an unsigned long long as 8 little endian bytes */
+void put8bytes(unsigned char *ptr, unsigned long long val)
+{
+    if (little_endian) {
+        put4bytes(ptr,val & 0xffffffff);
+        put4bytes(ptr+4,val >> 32);
+    } else {
+        put4bytes(ptr,val >> 32);
+        put4bytes(ptr+4,val & 0xffffffff);
+    }
+}
+
+/* Read len bytes at offset off of the file open on fd, restarting after
+   interruptions and short reads.  Uses pread() so that no file position is
+   shared between readers.  Returns 0 on success, -1 on error or if the
+   file ends first */
+int readat(int fd, void *buf, size_t len, off_t off)
+{
+    ssize_t n;
+    unsigned char *p = buf;
+
+    while (len) {
+        if ((n = pread(fd,p,len,off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return(-1);
+        }
+        if (n == 0) {
+            errno = EIO;
+            return(-1);
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return(0);
+}
+
+/* Write len bytes at offset off of the file open on fd.  The pwrite()
+   counterpart of readat() */
+int writeat(int fd, const void *buf, size_t len, off_t off)
+{
+    ssize_t n;
+    const unsigned char *p = buf;
+
+    while (len) {
+        if ((n = pwrite(fd,p,len,off)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return(-1);
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return(0);
+}
+
+/* The records at the end of a zip file which locate its central directory,
+   as read by read_trailer() */
+struct zip_trailer {
+    off_t fsize;                    /* Size of the file */
+    off_t eocdr_off;                /* Offset of the EOCDR */
+    off_t z64_eocdr_off;            /* Offset of the Zip64 EOCDR or -1 */
+    off_t cd_off;                   /* Offset of the central directory */
+    off_t cd_size;                  /* Size of the central directory */
+    unsigned long long entries;     /* Number of central directory entries */
+    unsigned this_disk;             /* Number of this disk */
+    unsigned cd_disk;               /* Disk on which the central dir starts */
+    off_t trailing;                 /* Bytes following the EOCDR */
+    int z64_missing;                /* EOCDR needs Zip64 records it lacks */
+    unsigned short comment_len;     /* Zip file comment length */
+    unsigned char comment[MAX_COMMENT];
+};
+
+/* Fill in zt from the EOCDR at ptr (at offset off in the file open on fd)
+   and the Zip64 records it refers to, checking that they are consistent
+   and that the central directory offset really points at a central
+   directory header.  Returns 0 on success, -1 (with a message in errbuf)
+   if not */
+int parse_trailer(int fd, struct zip_trailer *zt, const unsigned char *ptr,
+        off_t off, char *errbuf)
+{
+    unsigned char z64[Z64_EOCDR_SIZE],cdsig[SIG_LEN];
+
+    zt->eocdr_off = off;
+    zt->this_disk = get2bytes(ptr+4);
+    zt->cd_disk = get2bytes(ptr+6);
+    zt->entries = get2bytes(ptr+10);
+    zt->cd_size = get4bytes(ptr+12);
+    zt->cd_off = get4bytes(ptr+16);
+    zt->comment_len = get2bytes(ptr+20);
+    memcpy(zt->comment,ptr+EOCDR_BASE_SIZE,zt->comment_len);
+    zt->trailing = zt->fsize - off - EOCDR_BASE_SIZE - zt->comment_len;
+    zt->z64_eocdr_off = -1;
+    zt->z64_missing = 0;
+
+    /* If there's a Zip64 EOCDL, its EOCDR supersedes the values above */
+    if (off >= Z64_EOCDL_SIZE &&
+            get4bytes(ptr-Z64_EOCDL_SIZE) == Z64_EOCDL_SIG) {
+        zt->z64_eocdr_off = get8bytes(ptr-Z64_EOCDL_SIZE+8);
+        if (zt->z64_eocdr_off + Z64_EOCDR_SIZE > off ||
+                readat(fd,z64,Z64_EOCDR_SIZE,zt->z64_eocdr_off) ||
+                get4bytes(z64) != Z64_EOCDR_SIG) {
+            snprintf(errbuf,ERRMAX,"Bad Zip64 EOCDR");
+            return(-1);
+        }
+        zt->this_disk = get4bytes(z64+16);
+        zt->cd_disk = get4bytes(z64+20);
+        zt->entries = get8bytes(z64+32);
+        zt->cd_size = get8bytes(z64+40);
+        zt->cd_off = get8bytes(z64+48);
+    } else if (zt->cd_off + zt->cd_size != off && zt->cd_size <= off &&
+            (off - zt->cd_size) % WRAP == zt->cd_off) {
+        /* A writer which doesn't know about Zip64 has stored the offset
+           of a central directory beyond 4GB modulo 2^32: it's really just
+           before the EOCDR */
+        zt->cd_off = off - zt->cd_size;
+    } else if (zt->cd_off == 0xffffffff || zt->cd_size == 0xffffffff ||
+            zt->entries == 0xffff) {
+        /* Zip64 values, but no Zip64 records to find them in */
+        zt->z64_missing = 1;
+        snprintf(errbuf,ERRMAX,"Zip64 end records missing");
+        return(-1);
+    }
+
+    if (zt->this_disk != zt->cd_disk) {
+        snprintf(errbuf,ERRMAX,"Not start disk");
+        return(-1);
+    }
+    if (zt->cd_off + zt->cd_size > off || (zt->entries &&
+            (readat(fd,cdsig,SIG_LEN,zt->cd_off) ||
+            get4bytes(cdsig) != CD_SIG))) {
+        snprintf(errbuf,ERRMAX,"Central directory not found");
+        return(-1);
+    }
+    return(0);
+}
+
+/* Locate the EOCDR and (if present) the Zip64 EOCDL and EOCDR at the end
+   of the file open on fd and fill in zt from them.  Unlike fixup() this
+   uses the Zip64 records whenever they are present, and checks that the
+   central directory offset really points at a central directory header.
+   If FIX_GARBAGE is set in flags, the last EOCDR which passes those checks
+   is used even if it doesn't end the file.  Returns 0 on success, -1
+   (with a message in errbuf) on error */
+int read_trailer(int fd, struct zip_trailer *zt, int flags, char *errbuf)
+{
+    struct stat sbuf;
+    unsigned char *buf,*ptr,*minptr;
+    size_t window,end;
+    off_t winoff;
+
+    if (fstat(fd,&sbuf)) {
+        snprintf(errbuf,ERRMAX,"Failed to stat: %s",strerror(errno));
+        return(-1);
+    }
+    if ((zt->fsize = sbuf.st_size) < EOCDR_BASE_SIZE) {
+        snprintf(errbuf,ERRMAX,"Not a zip file");
+        return(-1);
+    }
+
+    window = zt->fsize > TAIL_WINDOW ? TAIL_WINDOW : zt->fsize;
+    winoff = zt->fsize - window;
+    if ((buf = malloc(window)) == NULL) {
+        snprintf(errbuf,ERRMAX,"Out of memory");
+        return(-1);
+    }
+    if (readat(fd,buf,window,winoff)) {
+        snprintf(errbuf,ERRMAX,"Failed to read: %s",strerror(errno));
+        free(buf);
+        return(-1);
+    }
+
+    /* Look backwards for an EOCDR signature whose comment reaches exactly
+       to the end of the file (or not beyond it if we allow garbage).  Unless
+       the window starts at the start of the file, stop early enough that
+       parse_trailer() can look for a Zip64 EOCDL before it in the window */
+    snprintf(errbuf,ERRMAX,"No EOCDR found");
+    minptr = winoff ? buf + Z64_EOCDL_SIZE : buf;
+    for (ptr = buf + window - EOCDR_BASE_SIZE; ptr >= minptr; --ptr) {
+        if (get4bytes(ptr) != EOCDR_SIG) {
+            continue;
+        }
+        end = (ptr - buf) + EOCDR_BASE_SIZE + get2bytes(ptr+20);
+        if (end == window) {
+            /* A proper EOCDR: this is it, good or bad */
+            break;
+        }
+        if (end < window && (flags & FIX_GARBAGE) &&
+                parse_trailer(fd,zt,ptr,winoff + (ptr - buf),errbuf) == 0) {
+            free(buf);
+            *errbuf = '\0';
+            return(0);
+        }
+    }
+    if (ptr < minptr ||
+            parse_trailer(fd,zt,ptr,winoff + (ptr - buf),errbuf)) {
+        free(buf);
+        return(-1);
+    }
+    free(buf);
+    *errbuf = '\0';
+    return(0);
+}
+
+/* Build the trailer records for a central directory of cd_size bytes
+   holding entries entries at offset cd_off, to be written at offset at:
+   a Zip64 EOCDR and EOCDL if needed (or if the original had them), then
+   the EOCDR with the original comment.  Returns the length of the Zip64
+   records in *z64len and the total length of the trailer */
+size_t build_trailer(unsigned char *buf, const struct zip_trailer *zt,
+        off_t at, off_t cd_off, off_t cd_size, unsigned long long entries,
+        size_t *z64len)
+{
+    unsigned char *ptr = buf;
+    int zip64;
+
+    zip64 = zt->z64_eocdr_off >= 0 || entries >= 0xffff ||
+            cd_size >= 0xffffffff || cd_off >= 0xffffffff;
+
+    if (zip64) {
+        put4bytes(ptr,Z64_EOCDR_SIG);
+        put8bytes(ptr+4,Z64_EOCDR_SIZE - 12);
+        put2bytes(ptr+12,45);           /* Version made by */
+        put2bytes(ptr+14,45);           /* Version needed to extract */
+        put4bytes(ptr+16,0);            /* This disk */
+        put4bytes(ptr+20,0);            /* Disk where central dir starts */
+        put8bytes(ptr+24,entries);
+        put8bytes(ptr+32,entries);
+        put8bytes(ptr+40,cd_size);
+        put8bytes(ptr+48,cd_off);
+        ptr += Z64_EOCDR_SIZE;
+
+        put4bytes(ptr,Z64_EOCDL_SIG);
+        put4bytes(ptr+4,0);             /* Disk with the Zip64 EOCDR */
+        put8bytes(ptr+8,at);
+        put4bytes(ptr+16,1);            /* Total number of disks */
+        ptr += Z64_EOCDL_SIZE;
+    }
+    *z64len = ptr - buf;
+
+    put4bytes(ptr,EOCDR_SIG);
+    put2bytes(ptr+4,0);
+    put2bytes(ptr+6,0);
+    put2bytes(ptr+8,entries >= 0xffff ? 0xffff : entries);
+    put2bytes(ptr+10,entries >= 0xffff ? 0xffff : entries);
+    put4bytes(ptr+12,cd_size >= 0xffffffff ? 0xffffffff : cd_size);
+    put4bytes(ptr+16,cd_off >= 0xffffffff ? 0xffffffff : cd_off);
+    put2bytes(ptr+20,zt->comment_len);
+    memcpy(ptr+EOCDR_BASE_SIZE,zt->comment,zt->comment_len);
+    ptr += EOCDR_BASE_SIZE + zt->comment_len;
+
+    return(ptr - buf);
+}
+
+/* Write a trailer for the given central directory at offset at in two
+   steps: Zip64 records first, then (once those are on disk) the EOCDR
+   which makes them visible.  Returns 0 on success, -1 on error */
+int write_trailer(int fd, const struct zip_trailer *zt, off_t at,
+        off_t cd_off, off_t cd_size, unsigned long long entries)
+{
+    static unsigned char buf[TRAILER_MAX];
+    size_t len,z64len;
+
+    len = build_trailer(buf,zt,at,cd_off,cd_size,entries,&z64len);
+    if (writeat(fd,buf,z64len,at) || fsync(fd) ||
+            writeat(fd,buf+z64len,len-z64len,at+z64len) || fsync(fd)) {
+        return(-1);
+    }
+    return(0);
+}
+
+/* Copy len bytes within the file open on fd from src to dst */
+int copy_range(int fd, off_t src, off_t dst, off_t len)
+{
+    static unsigned char buf[COPY_CHUNK];
+    size_t n;
+
+    while (len) {
+        n = len > COPY_CHUNK ? COPY_CHUNK : len;
+        if (readat(fd,buf,n,src) || writeat(fd,buf,n,dst)) {
+            return(-1);
+        }
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    return(0);
+}
+
+/* Crash-safe switch to a new central directory.
+
+   The new central directory (cd_size bytes, entries entries) has already
+   been written (but not necessarily synced) at cd_off, the end of the
+   original file described by zt.  Readers expect the trailer to follow the
+   central directory immediately, so a directory can't be kept where it is
+   if its trailer has to grow.  Nothing before the end of the original file
+   is touched until a complete new trailer has been appended and synced, so
+   a crash leaves either the old archive or the new one intact:
+   * Append the Zip64 records after the new central directory and fsync,
+     then append the EOCDR and fsync.  The archive is now the new one, and
+     the old central directory and trailer are dead space.
+   * Unless keep_dead is set or there were bytes after the old EOCDR (which
+     are only removed if asked, with -t), and if the new central directory
+     and trailer fit in the space from the old central directory to the old
+     end of file (so that copying never overwrites what we are copying
+     from), copy them down over the old ones, fsync and truncate the file
+     after them.
+
+   Returns the number of bytes of dead space left in the file, or -1 on
+   error with a message in errbuf.  If the new trailer can't be written,
+   the file is truncated to its old length, so it is the old archive again;
+   if copying down fails, the appended copy is left in use */
+off_t switch_trailer(int fd, const struct zip_trailer *zt, off_t cd_off,
+        off_t cd_size, unsigned long long entries, int keep_dead,
+        char *errbuf)
+{
+    static unsigned char buf[TRAILER_MAX];
+    off_t dst = zt->cd_off,end;
+    size_t len,z64len;
+
+    if (fsync(fd) || write_trailer(fd,zt,cd_off+cd_size,cd_off,cd_size,
+            entries)) {
+        snprintf(errbuf,ERRMAX,"Failed to write trailer: %s",strerror(errno));
+        /* The old trailer still describes the file once the partial new
+           one is gone */
+        (void) ftruncate(fd,zt->fsize);
+        return(-1);
+    }
+
+    /* See whether the new records fit where the old ones were */
+    len = build_trailer(buf,zt,dst+cd_size,dst,cd_size,entries,&z64len);
+    end = dst + cd_size + len;
+    if (keep_dead || zt->trailing || end > zt->fsize) {
+        return(zt->fsize - dst);
+    }
+
+    if (copy_range(fd,cd_off,dst,cd_size) ||
+            write_trailer(fd,zt,dst+cd_size,dst,cd_size,entries) ||
+            ftruncate(fd,end) || fsync(fd)) {
+        snprintf(errbuf,ERRMAX,"Failed to reclaim old central directory: %s",
+                strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+/* A central directory entry as passed to the callback of cd_walk().  The
+   pointers are into cd_walk()'s window and are only valid during the
+   callback.  Sizes, offset and disk have any Zip64 values applied, except
+   in cd_scan()'s lazy mode until cd_zip64() is called */
+struct cd_entry {
+    unsigned long long index;       /* Entry number, from 0 */
+    off_t off;                      /* Offset of this entry's header */
+    unsigned char *hdr;             /* Start of the header */
+    unsigned short flags;           /* General purpose bit flags */
+    unsigned short method;          /* Compression method */
+    unsigned crc;                   /* CRC-32 */
+    unsigned long long csize;       /* Compressed size */
+    unsigned long long usize;       /* Uncompressed size */
+    unsigned long long lho_off;     /* Local header offset */
+    unsigned disk;                  /* Disk on which the entry starts */
+    unsigned short name_len,extra_len,comment_len;
+    unsigned char *name,*extra,*comment;
+    int z64done;                    /* Zip64 values have been applied */
+};
+
+/* Step through the len bytes of extra fields at extra.  *pos is the offset
+   of the next field, and should start at 0.  Returns a pointer to the
+   field (its id, then its data length, then the data) with the data
+   length in *flen, or NULL at the end or at a field which claims to run
+   on past it */
+unsigned char *next_extra(unsigned char *extra, unsigned len, unsigned *pos,
+        unsigned short *flen)
+{
+    unsigned char *field = extra + *pos;
+
+    if (len - *pos < 4 || (*flen = get2bytes(field+2)) > len - *pos - 4) {
+        return(NULL);
+    }
+    *pos += 4 + *flen;
+    return(field);
+}
+
+/* Find the extra field with the given id in the len bytes of extra fields
+   at extra.  Returns a pointer to its data and its data length in *dlen,
+   or NULL if not present */
+unsigned char *find_extra(unsigned char *extra, unsigned len,
+        unsigned short id, unsigned short *dlen)
+{
+    unsigned char *field;
+    unsigned pos = 0;
+
+    while ((field = next_extra(extra,len,&pos,dlen)) != NULL) {
+        if (get2bytes(field) == id) {
+            return(field+4);
+        }
+    }
+    return(NULL);
+}
+
+/* Decode the fixed part of the central directory header at hdr into ent,
+   and point ent at its name, extra fields and comment.  Zip64 values are
+   left for cd_zip64() */
+void cd_decode(unsigned char *hdr, struct cd_entry *ent)
+{
+    ent->hdr = hdr;
+    ent->flags = get2bytes(hdr+8);
+    ent->method = get2bytes(hdr+10);
+    ent->crc = get4bytes(hdr+16);
+    ent->csize = get4bytes(hdr+20);
+    ent->usize = get4bytes(hdr+24);
+    ent->name_len = get2bytes(hdr+28);
+    ent->extra_len = get2bytes(hdr+30);
+    ent->comment_len = get2bytes(hdr+32);
+    ent->disk = get2bytes(hdr+34);
+    ent->lho_off = get4bytes(hdr+42);
+    ent->name = hdr + CD_BASE_SIZE;
+    ent->extra = ent->name + ent->name_len;
+    ent->comment = ent->extra + ent->extra_len;
+    ent->z64done = 0;
+}
+
+/* Apply values from the Zip64 extra field of an entry decoded by
+   cd_decode(), if not already done.  Returns 0, or -1 if a Zip64 value
+   which should be present is missing */
+int cd_zip64(struct cd_entry *ent)
+{
+    unsigned char *z64;
+    unsigned short z64len = 0;
+
+    if (ent->z64done) {
+        return(0);
+    }
+
+    /* Zip64 values are present, in this order, only for those fields which
+       are all ones in the fixed part of the header */
+    z64 = find_extra(ent->extra,ent->extra_len,Z64_EXTRA_ID,&z64len);
+    if (ent->usize == 0xffffffff) {
+        if (z64len < 8) {
+            return(-1);
+        }
+        ent->usize = get8bytes(z64);
+        z64 += 8;
+        z64len -= 8;
+    }
+    if (ent->csize == 0xffffffff) {
+        if (z64len < 8) {
+            return(-1);
+        }
+        ent->csize = get8bytes(z64);
+        z64 += 8;
+        z64len -= 8;
+    }
+    if (ent->lho_off == 0xffffffff) {
+        if (z64len < 8) {
+            return(-1);
+        }
+        ent->lho_off = get8bytes(z64);
+        z64 += 8;
+        z64len -= 8;
+    }
+    if (ent->disk == 0xffff) {
+        if (z64len < 4) {
+            return(-1);
+        }
+        ent->disk = get4bytes(z64);
+    }
+    ent->z64done = 1;
+    return(0);
+}
+
+/* Walk the central directory described by zt, calling fn for each entry
+   in turn.  The directory is read through a fixed size window, so memory
+   use doesn't depend on the size of the directory.  Stops early if fn
+   returns non-zero.  If lazy, Zip64 extra fields are only looked at if
+   fn calls cd_zip64(), so that searches by name can skip them.  Returns
+   the number of entries walked, or -1 (with a message in errbuf) if the
+   directory is malformed, can't be read or fn returns -1.  fn should leave
+   any message in errbuf */
+long long cd_scan(int fd, const struct zip_trailer *zt,
+        int (*fn)(struct cd_entry *, void *, char *), void *arg, int lazy,
+        char *errbuf)
+{
+    static unsigned char buf[CD_WINDOW];
+    struct cd_entry ent;
+    off_t pos = zt->cd_off,end = zt->cd_off + zt->cd_size,bufoff = pos;
+    size_t have = 0,used = 0,need,n;
+    unsigned char *hdr = buf;
+    int r,pass;
+
+    for (ent.index = 0; pos < end; ent.index++) {
+        /* Make sure first the fixed part, then the whole of this header is
+           in the window, sliding what's left of the window down and
+           refilling it if not */
+        for (pass = 0, need = CD_BASE_SIZE; pass < 2; pass++, need =
+                CD_BASE_SIZE + get2bytes(hdr+28) + get2bytes(hdr+30) +
+                get2bytes(hdr+32)) {
+            if (pos + (off_t) need > end) {
+                snprintf(errbuf,ERRMAX,"Central directory entry %llu "
+                        "runs past end of directory",ent.index);
+                return(-1);
+            }
+            if (used + need > have) {
+                memmove(buf,buf+used,have-used);
+                have -= used;
+                bufoff += used;
+                used = 0;
+                n = end - bufoff - (off_t) have > (off_t) (CD_WINDOW - have) ?
+                        CD_WINDOW - have : (size_t) (end - bufoff - have);
+                if (readat(fd,buf+have,n,bufoff+have)) {
+                    snprintf(errbuf,ERRMAX,"Failed to read central "
+                            "directory: %s",strerror(errno));
+                    return(-1);
+                }
+                have += n;
+            }
+            hdr = buf + used;
+            if (pass == 0 && get4bytes(hdr) != CD_SIG) {
+                snprintf(errbuf,ERRMAX,"Bad signature for central directory "
+                        "entry %llu",ent.index);
+                return(-1);
+            }
+        }
+
+        ent.off = pos;
+        cd_decode(hdr,&ent);
+        if (!lazy && cd_zip64(&ent)) {
+            snprintf(errbuf,ERRMAX,"Bad Zip64 extra field for central "
+                    "directory entry %llu",ent.index);
+            return(-1);
+        }
+        if ((r = fn(&ent,arg,errbuf)) != 0) {
+            return(r < 0 ? -1 : (long long) ent.index + 1);
+        }
+        used += need;
+        pos += need;
+    }
+    return(ent.index);
+}
+
+/* cd_scan() with every entry fully decoded */
+long long cd_walk(int fd, const struct zip_trailer *zt,
+        int (*fn)(struct cd_entry *, void *, char *), void *arg, char *errbuf)
+{
+    return(cd_scan(fd,zt,fn,arg,0,errbuf));
+}
+
+/* The part of a file taken up by an entry's local header and data */
+struct extent {
+    unsigned long long start,end;
+};
+
+/* Extents to be checked for overlaps.  They are sorted in runs of up to
+   RUN_MAX in memory, and full runs are spilled to a temporary file, so
+   memory use is bounded however many entries there are */
+struct extent_runs {
+    struct extent *buf;             /* Current run */
+    size_t n;
+    FILE *tmp;                      /* Spilled runs, each RUN_MAX long */
+    unsigned long long nruns;
+};
+
+/* One spilled run being merged by check_extents() */
+struct run_cursor {
+    off_t pos,end;                  /* Next and last+1 extent in the file */
+    size_t have,used;
+    struct extent buf[RUN_BUF];
+    struct extent head;             /* Next extent of the run in order */
+};
+
+/* qsort() comparison for extents by start */
+int cmp_extent(const void *a, const void *b)
+{
+    const struct extent *x = a, *y = b;
+
+    return(x->start < y->start ? -1 : x->start > y->start);
+}
+
+/* Sort the current run and append it to the temporary file.  Returns 0,
+   or -1 with a message in errbuf */
+int spill_run(struct extent_runs *er, char *errbuf)
+{
+    qsort(er->buf,er->n,sizeof(*er->buf),cmp_extent);
+    if ((er->tmp == NULL && (er->tmp = tmpfile()) == NULL) ||
+            fwrite(er->buf,sizeof(*er->buf),er->n,er->tmp) != er->n) {
+        snprintf(errbuf,ERRMAX,"Failed to write temporary file: %s",
+                strerror(errno));
+        return(-1);
+    }
+    er->nruns++;
+    er->n = 0;
+    return(0);
+}
+
+/* Add an extent to be checked.  Returns 0, or -1 with a message in
+   errbuf */
+int add_extent(struct extent_runs *er, unsigned long long start,
+        unsigned long long end, char *errbuf)
+{
+    if (er->buf == NULL &&
+            (er->buf = malloc(RUN_MAX * sizeof(*er->buf))) == NULL) {
+        snprintf(errbuf,ERRMAX,"Out of memory");
+        return(-1);
+    }
+    if (er->n == RUN_MAX && spill_run(er,errbuf)) {
+        return(-1);
+    }
+    er->buf[er->n].start = start;
+    er->buf[er->n].end = end;
+    er->n++;
+    return(0);
+}
+
+/* Free what's left of a set of extents */
+void free_extents(struct extent_runs *er)
+{
+    free(er->buf);
+    if (er->tmp) {
+        (void) fclose(er->tmp);
+    }
+    memset(er,0,sizeof(*er));
+}
+
+/* Load the next extent of a spilled run into its head.  Returns 1 if
+   there was one, 0 at the end of the run or -1 on read error */
+int run_next(struct run_cursor *rc, int fd)
+{
+    size_t n;
+
+    if (rc->used == rc->have) {
+        if (rc->pos == rc->end) {
+            return(0);
+        }
+        n = rc->end - rc->pos > RUN_BUF ? RUN_BUF : rc->end - rc->pos;
+        if (readat(fd,rc->buf,n * sizeof(*rc->buf),
+                rc->pos * sizeof(*rc->buf))) {
+            return(-1);
+        }
+        rc->pos += n;
+        rc->have = n;
+        rc->used = 0;
+    }
+    rc->head = rc->buf[rc->used++];
+    return(1);
+}
+
+/* Restore the order of a heap of runs (by the start of their heads) after
+   the run at i has been replaced */
+void sift_down(struct run_cursor *rc, unsigned long long *heap,
+        unsigned long long n, unsigned long long i)
+{
+    unsigned long long j,t;
+
+    for (; (j = 2 * i + 1) < n; i = j) {
+        if (j + 1 < n && rc[heap[j+1]].head.start < rc[heap[j]].head.start) {
+            j++;
+        }
+        if (rc[heap[i]].head.start <= rc[heap[j]].head.start) {
+            break;
+        }
+        t = heap[i];
+        heap[i] = heap[j];
+        heap[j] = t;
+    }
+}
+
+/* Check that no two extents overlap (or start at the same offset), going
+   through them in order of start: in memory if they fit in one run,
+   otherwise by merging the spilled runs through a heap, which needs only
+   a small buffer per run.  Frees the extents.  Returns 0, or -1 with a
+   message in errbuf */
+int check_extents(struct extent_runs *er, char *errbuf)
+{
+    struct run_cursor *rc = NULL;
+    unsigned long long *heap = NULL,nheap = 0,i,done,total;
+    struct extent cur;
+    unsigned long long end = 0;
+    int fd = -1,r,res = -1;
+
+    if (!er->nruns) {
+        qsort(er->buf,er->n,sizeof(*er->buf),cmp_extent);
+        total = er->n;
+    } else {
+        if ((er->n && spill_run(er,errbuf))) {
+            free_extents(er);
+            return(-1);
+        }
+        total = ftello(er->tmp) / sizeof(struct extent);
+        if (fflush(er->tmp)) {
+            snprintf(errbuf,ERRMAX,"Failed to write temporary file: %s",
+                    strerror(errno));
+            free_extents(er);
+            return(-1);
+        }
+        fd = fileno(er->tmp);
+        rc = malloc(er->nruns * sizeof(*rc));
+        heap = malloc(er->nruns * sizeof(*heap));
+        if (rc == NULL || heap == NULL) {
+            snprintf(errbuf,ERRMAX,"Out of memory");
+            goto out;
+        }
+        for (i = 0; i < er->nruns; i++) {
+            rc[i].pos = i * RUN_MAX;
+            rc[i].end = i + 1 < er->nruns ? (i + 1) * RUN_MAX : total;
+            rc[i].have = rc[i].used = 0;
+            if (run_next(&rc[i],fd) < 0) {
+                goto readerr;
+            }
+            heap[nheap++] = i;
+        }
+        for (i = nheap / 2; i-- > 0; ) {
+            sift_down(rc,heap,nheap,i);
+        }
+    }
+
+    for (done = 0; done < total; done++) {
+        /* Take the next extent in order of start */
+        if (!er->nruns) {
+            cur = er->buf[done];
+        } else {
+            cur = rc[heap[0]].head;
+            if ((r = run_next(&rc[heap[0]],fd)) < 0) {
+                goto readerr;
+            } else if (r == 0) {
+                heap[0] = heap[--nheap];
+            }
+            sift_down(rc,heap,nheap,0);
+        }
+
+        if (done && cur.start < end) {
+            snprintf(errbuf,ERRMAX,"Entry at offset %llu overlaps entry "
+                    "ending at %llu",cur.start,end);
+            goto out;
+        }
+        end = cur.end;
+    }
+    res = 0;
+    goto out;
+
+readerr:
+    snprintf(errbuf,ERRMAX,"Failed to read temporary file: %s",
+            strerror(errno));
+out:
+    free(rc);
+    free(heap);
+    free_extents(er);
+    return(res);
+}
+
+/* State for checkcd()'s cd_walk() callback */
+struct check_scan {
+    const struct zip_trailer *zt;
+    struct extent_runs er;
+};
+
+/* cd_walk() callback for checkcd(): check that each entry's local header
+   lies before the central directory, and note the part of the file its
+   local header and data take up.  The local header's extra fields aren't
+   known without reading it, so they're left out: the extent may be short
+   but is never too long */
+int check_entry(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct check_scan *cs = arg;
+    const struct zip_trailer *zt = cs->zt;
+
+    if (ent->disk != zt->cd_disk || (off_t) ent->lho_off >= zt->cd_off) {
+        snprintf(errbuf,ERRMAX,"Central directory entry %llu has local "
+                "header offset %llu beyond central directory",ent->index,
+                ent->lho_off);
+        return(-1);
+    }
+    return(add_extent(&cs->er,ent->lho_off,ent->lho_off + LH_BASE_SIZE +
+            ent->name_len + ent->csize,errbuf));
+}
+
+/* A new central directory being appended to a file, buffered so that it
+   is written a window at a time */
+struct cd_writer {
+    int fd;
+    off_t start;                    /* Where the directory starts */
+    off_t len;                      /* Bytes written (or buffered) so far */
+    unsigned long long entries;     /* Entries written so far */
+    size_t used;                    /* Bytes in buf */
+    unsigned char buf[CD_WINDOW];
+};
+
+/* Write out anything buffered by a cd_writer (or just discard it if its
+   fd is -1, for dry runs).  Returns 0 or -1 */
+int cdw_flush(struct cd_writer *cw)
+{
+    if (cw->used && cw->fd >= 0 && writeat(cw->fd,cw->buf,cw->used,
+            cw->start + cw->len - cw->used)) {
+        return(-1);
+    }
+    cw->used = 0;
+    return(0);
+}
+
+/* Add len bytes to a new central directory.  Returns 0 or -1 */
+int cdw_write(struct cd_writer *cw, const void *data, size_t len)
+{
+    if (cw->used + len > CD_WINDOW && cdw_flush(cw)) {
+        return(-1);
+    }
+    memcpy(cw->buf+cw->used,data,len);
+    cw->used += len;
+    cw->len += len;
+    return(0);
+}
+
+/* Add an entry to a new central directory.  The fixed part of the header
+   comes from ent->hdr, but with the name, extra fields and comment at
+   ent->name etc. (which may have been changed), and sizes, offset and disk
+   from ent.  Any Zip64 extra field in ent->extra is replaced with one
+   holding whichever of those values need it.  Returns 0 or -1 with a
+   message in errbuf */
+int cdw_entry(struct cd_writer *cw, const struct cd_entry *ent, char *errbuf)
+{
+    unsigned char hdr[CD_BASE_SIZE],z64[4+28],*ptr = z64+4,*extra;
+    unsigned extra_len,pos;
+    unsigned short flen,z64len;
+
+    memcpy(hdr,ent->hdr,CD_BASE_SIZE);
+    if (ent->usize >= 0xffffffff) {
+        put4bytes(hdr+24,0xffffffff);
+        put8bytes(ptr,ent->usize);
+        ptr += 8;
+    } else {
+        put4bytes(hdr+24,ent->usize);
+    }
+    if (ent->csize >= 0xffffffff) {
+        put4bytes(hdr+20,0xffffffff);
+        put8bytes(ptr,ent->csize);
+        ptr += 8;
+    } else {
+        put4bytes(hdr+20,ent->csize);
+    }
+    if (ent->lho_off >= 0xffffffff) {
+        put4bytes(hdr+42,0xffffffff);
+        put8bytes(ptr,ent->lho_off);
+        ptr += 8;
+    } else {
+        put4bytes(hdr+42,ent->lho_off);
+    }
+    if (ent->disk >= 0xffff) {
+        put2bytes(hdr+34,0xffff);
+        put4bytes(ptr,ent->disk);
+        ptr += 4;
+    } else {
+        put2bytes(hdr+34,ent->disk);
+    }
+    z64len = ptr - z64 - 4;
+    put2bytes(z64,Z64_EXTRA_ID);
+    put2bytes(z64+2,z64len);
+
+    /* Work out how long the extra fields will be without the old Zip64
+       field and with the new one.  Anything after a field which runs past
+       the end of the extra fields is dropped */
+    extra_len = z64len ? z64len + 4 : 0;
+    for (pos = 0; (extra = next_extra(ent->extra,ent->extra_len,&pos,&flen))
+            != NULL; ) {
+        if (get2bytes(extra) != Z64_EXTRA_ID) {
+            extra_len += 4 + flen;
+        }
+    }
+    if (extra_len > 0xffff) {
+        snprintf(errbuf,ERRMAX,"No room for Zip64 extra field in entry %llu",
+                ent->index);
+        return(-1);
+    }
+
+    put2bytes(hdr+28,ent->name_len);
+    put2bytes(hdr+30,extra_len);
+    put2bytes(hdr+32,ent->comment_len);
+    if (z64len && get2bytes(hdr+6) < 45) {
+        put2bytes(hdr+6,45);        /* Version needed for Zip64 */
+    }
+
+    if (cdw_write(cw,hdr,CD_BASE_SIZE) ||
+            cdw_write(cw,ent->name,ent->name_len)) {
+        goto fail;
+    }
+    for (pos = 0; (extra = next_extra(ent->extra,ent->extra_len,&pos,&flen))
+            != NULL; ) {
+        if (get2bytes(extra) != Z64_EXTRA_ID && cdw_write(cw,extra,4 + flen)) {
+            goto fail;
+        }
+    }
+    if ((z64len && cdw_write(cw,z64,z64len + 4)) ||
+            cdw_write(cw,ent->comment,ent->comment_len)) {
+        goto fail;
+    }
+    cw->entries++;
+    return(0);
+
+fail:
+    snprintf(errbuf,ERRMAX,"Failed to write central directory: %s",
+            strerror(errno));
+    return(-1);
+}
+
+/* State for rewrite_cd()'s cd_walk() callback */
+struct rewrite {
+    struct cd_writer *cw;
+    off_t cd_off;                   /* Where the old directory starts */
+    int (*edit)(struct cd_entry *, void *, char *);
+    void *arg;
+    unsigned long long changed;     /* Entries edit() changed */
+};
+
+/* cd_walk() callback for rewrite_cd(): edit an entry and append it to the
+   new central directory.  Unchanged entries are copied as they are.
+   Nothing is written until the first entry changes: then the unchanged
+   entries before it are copied from the old directory in one go */
+int rewrite_entry(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct rewrite *rw = arg;
+    struct cd_writer *cw = rw->cw;
+    int r;
+
+    if ((r = rw->edit(ent,rw->arg,errbuf)) < 0) {
+        return(-1);
+    }
+    if (!r) {
+        if (rw->changed && cdw_write(cw,ent->hdr,CD_BASE_SIZE +
+                ent->name_len + ent->extra_len + ent->comment_len)) {
+            snprintf(errbuf,ERRMAX,"Failed to write central directory: %s",
+                    strerror(errno));
+            return(-1);
+        }
+        cw->entries += rw->changed != 0;
+        return(0);
+    }
+    if (!rw->changed) {
+        if (cw->fd >= 0 && copy_range(cw->fd,rw->cd_off,cw->start,
+                ent->off - rw->cd_off)) {
+            snprintf(errbuf,ERRMAX,"Failed to copy central directory: %s",
+                    strerror(errno));
+            return(-1);
+        }
+        cw->len = ent->off - rw->cd_off;
+        cw->entries = ent->index;
+    }
+    rw->changed++;
+    return(cdw_entry(cw,ent,errbuf) ? -1 : 0);
+}
+
+/* Rewrite the central directory of the file open on fd, described by zt,
+   passing each entry to edit() first.  edit() may change the entry's
+   sizes, offset and disk, and point its name, extra fields and comment
+   elsewhere (valid until the next call), and returns 1 if it changed the
+   entry, 0 if not or -1 on error.  If nothing changes, or in a dry run,
+   the file is left alone: otherwise the new central directory is appended
+   to the file and switched to with switch_trailer().  If writing the new
+   directory fails, the file is truncated back to its old length.  Returns
+   the number of entries changed or -1 on error, with a message in errbuf.
+   The dead space left in the file is returned in *dead */
+long long rewrite_cd(int fd, const struct zip_trailer *zt,
+        int (*edit)(struct cd_entry *, void *, char *), void *arg,
+        int flags, off_t *dead, char *errbuf)
+{
+    static struct cd_writer cw;
+    struct rewrite rw;
+
+    cw.fd = fd;
+    cw.start = zt->fsize;
+    cw.len = 0;
+    cw.entries = 0;
+    cw.used = 0;
+    rw.cw = &cw;
+    rw.cd_off = zt->cd_off;
+    rw.edit = edit;
+    rw.arg = arg;
+    rw.changed = 0;
+    *dead = 0;
+
+    /* In a dry run, just find out what edit() would change */
+    if (flags & FIX_DRYRUN) {
+        cw.fd = -1;
+    }
+    if (cd_walk(fd,zt,rewrite_entry,&rw,errbuf) < 0 ||
+            (rw.changed && cdw_flush(&cw))) {
+        if (!*errbuf) {
+            snprintf(errbuf,ERRMAX,"Failed to write central directory: %s",
+                    strerror(errno));
+        }
+        goto fail;
+    }
+    if (cw.fd < 0 || !rw.changed) {
+        return(rw.changed);
+    }
+
+    /* switch_trailer() cleans up after itself */
+    if ((*dead = switch_trailer(fd,zt,cw.start,cw.len,cw.entries,
+            flags & FIX_KEEPDEAD,errbuf)) < 0) {
+        return(-1);
+    }
+    return(rw.changed);
+
+fail:
+    /* Drop anything appended: the old trailer still describes the file */
+    if (cw.fd >= 0 && rw.changed) {
+        (void) ftruncate(fd,zt->fsize);
+    }
+    return(-1);
+}
+
+/* Open a zip file for a step run from main(), for writing unless it's a
+   dry run, and read its trailer.  Returns the file descriptor, or -1 with
+   a message in errbuf */
+int open_archive(char *filename, struct zip_trailer *zt, int flags,
+        char *errbuf)
+{
+    int fd;
+
+    if ((fd = open(filename,(flags & FIX_DRYRUN)?O_RDONLY:O_RDWR)) < 0) {
+        snprintf(errbuf,ERRMAX,"Failed to open %s: %s",
+                filename,strerror(errno));
+        return(-1);
+    }
+    if (read_trailer(fd,zt,flags,errbuf)) {
+        (void) close(fd);
+        return(-1);
+    }
+    return(fd);
+}
+
+/* Check the central directory of a zip file: that each entry has a valid
+   signature and fits within the directory, that its local header is
+   before the directory, that no two entries overlap, and that the number
+   of entries matches the trailer.  flags are as for fixup().  Returns 0
+   if all is well, -1 otherwise, with a message in *err either way */
+int checkcd(char *filename, char **err, int flags)
+{
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    static struct check_scan cs;
+    long long n;
+    int fd;
+
+    *errbuf = '\0';
+    *err = errbuf;
+
+    if ((fd = open_archive(filename,&zt,flags|FIX_DRYRUN,errbuf)) < 0) {
+        return(-1);
+    }
+    cs.zt = &zt;
+    if ((n = cd_walk(fd,&zt,check_entry,&cs,errbuf)) < 0) {
+        (void) close(fd);
+        free_extents(&cs.er);
+        return(-1);
+    }
+    (void) close(fd);
+    if (check_extents(&cs.er,errbuf)) {
+        return(-1);
+    }
+
+    if ((unsigned long long) n != zt.entries) {
+        snprintf(errbuf,ERRMAX,"Central directory has %lld entries, "
+                "trailer says %llu",n,zt.entries);
+        return(-1);
+    }
+    snprintf(errbuf,ERRMAX,"%lld entries",n);
+    return(0);
+}
+
+#ifdef HAVE_ZLIB
+/* Read the csize bytes of entry data at offset off of the file open on fd,
+   compressed with method, and work out the uncompressed size and CRC-32.
+   Returns 0 on success, -1 on read error or 1 if the data can't be
+   decompressed (or uses a method we don't know) */
+int measure_entry(int fd, off_t off, unsigned long long csize,
+        unsigned short method, unsigned long long *usize, unsigned *crc)
+{
+    static unsigned char in[COPY_CHUNK],out[COPY_CHUNK];
+    z_stream zs;
+    size_t n;
+    int r = Z_OK;
+
+    *usize = 0;
+    *crc = crc32(0L,Z_NULL,0);
+
+    if (method == METHOD_STORED) {
+        for (; csize; csize -= n, off += n) {
+            n = csize > COPY_CHUNK ? COPY_CHUNK : csize;
+            if (readat(fd,in,n,off)) {
+                return(-1);
+            }
+            *crc = crc32(*crc,in,n);
+            *usize += n;
+        }
+        return(0);
+    }
+    if (method != METHOD_DEFLATED) {
+        return(1);
+    }
+
+    memset(&zs,0,sizeof(zs));
+    if (inflateInit2(&zs,-MAX_WBITS) != Z_OK) {
+        return(1);
+    }
+    for (; csize && r != Z_STREAM_END; csize -= n, off += n) {
+        n = csize > COPY_CHUNK ? COPY_CHUNK : csize;
+        if (readat(fd,in,n,off)) {
+            (void) inflateEnd(&zs);
+            return(-1);
+        }
+        zs.next_in = in;
+        zs.avail_in = n;
+
+        /* Keep going while the output buffer fills: there may be more
+           output pending even when all the input has been used */
+        do {
+            zs.next_out = out;
+            zs.avail_out = COPY_CHUNK;
+            r = inflate(&zs,Z_NO_FLUSH);
+            if (r == Z_BUF_ERROR) {
+                r = Z_OK;           /* No progress possible: need input */
+            } else if (r != Z_OK && r != Z_STREAM_END) {
+                (void) inflateEnd(&zs);
+                return(1);
+            }
+            *crc = crc32(*crc,out,COPY_CHUNK - zs.avail_out);
+            *usize += COPY_CHUNK - zs.avail_out;
+        } while (zs.avail_out == 0 && r != Z_STREAM_END);
+    }
+    (void) inflateEnd(&zs);
+
+    /* The stream must end exactly at the end of the data */
+    return((r == Z_STREAM_END && !zs.avail_in && !csize) ? 0 : 1);
+}
+#else
+/* Without zlib no entry can be measured (main() refuses -s) */
+int measure_entry(int fd, off_t off, unsigned long long csize,
+        unsigned short method, unsigned long long *usize, unsigned *crc)
+{
+    (void) fd;
+    (void) off;
+    (void) csize;
+    (void) method;
+    (void) usize;
+    (void) crc;
+    return(1);
+}
+#endif
+
+/* An entry whose sizes fixsizes() has corrected */
+struct size_repair {
+    unsigned long long index;       /* Entry number */
+    unsigned long long csize;       /* Real compressed size */
+    unsigned long long usize;       /* Real uncompressed size */
+};
+
+/* The offsets of all the local headers in a zip file, so that we can find
+   what follows each entry */
+struct offset_list {
+    unsigned long long *offsets;    /* Local header offsets, sorted */
+    unsigned long long n;
+    unsigned long long max;
+    off_t end;                      /* Offset of the central directory */
+};
+
+/* State shared by fixsizes()'s cd_walk() callbacks */
+struct size_scan {
+    int fd;
+    const struct zip_trailer *zt;
+    struct offset_list ol;          /* Where each local header is */
+    struct size_repair *repairs;    /* Repairs, in entry order */
+    unsigned long long nrepairs;
+    unsigned long long maxrepairs;
+    unsigned long long next;        /* Next repair to apply */
+    unsigned long long bad;         /* Suspect entries we couldn't repair */
+};
+
+/* qsort() comparison for offsets */
+int cmp_offset(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return(x < y ? -1 : x > y);
+}
+
+/* Add an offset to an offset_list.  Returns 0, or -1 if out of memory */
+int add_offset(struct offset_list *ol, unsigned long long off, char *errbuf)
+{
+    unsigned long long *p;
+
+    if (ol->n == ol->max) {
+        ol->max = ol->max ? ol->max * 2 : 1024;
+        if ((p = realloc(ol->offsets,ol->max * sizeof(*p))) == NULL) {
+            snprintf(errbuf,ERRMAX,"Out of memory");
+            return(-1);
+        }
+        ol->offsets = p;
+    }
+    ol->offsets[ol->n++] = off;
+    return(0);
+}
+
+/* Return the offset of whatever follows the entry whose local header is at
+   off: the next local header, or the central directory.  The offsets must
+   have been sorted */
+off_t next_offset(const struct offset_list *ol, unsigned long long off)
+{
+    unsigned long long lo = 0,hi = ol->n,mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ol->offsets[mid] <= off) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return(lo < ol->n ? (off_t) ol->offsets[lo] : ol->end);
+}
+
+/* cd_walk() callback for fixsizes(): note where each local header is */
+int collect_offset(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct size_scan *ss = arg;
+
+    return(add_offset(&ss->ol,ent->lho_off,errbuf));
+}
+
+/* cd_walk() callback for fixsizes(): find entries without a Zip64 size
+   whose data runs to the next header a multiple of 4GB further than the
+   compressed size says, and work out their real sizes */
+int find_truncated(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct size_scan *ss = arg;
+    struct size_repair *p;
+    unsigned char lh[LH_BASE_SIZE];
+    const int ddlen[] = {12,16,20,24};  /* Possible data descriptor sizes */
+    off_t data,room,diff;
+    unsigned long long usize;
+    unsigned crc;
+    int i,r;
+
+    /* Only entries with at least 4GB more room than their compressed size
+       are worth reading the local header of */
+    if (get4bytes(ent->hdr+20) == 0xffffffff ||
+            next_offset(&ss->ol,ent->lho_off) - (off_t) ent->lho_off <
+            (off_t) ent->csize + WRAP) {
+        return(0);
+    }
+    if (readat(ss->fd,lh,LH_BASE_SIZE,ent->lho_off)) {
+        snprintf(errbuf,ERRMAX,"Failed to read local header for entry %llu: "
+                "%s",ent->index,strerror(errno));
+        return(-1);
+    }
+
+    /* A misplaced local header is a job for fixoffsets() */
+    if (get4bytes(lh) != LH_SIG) {
+        return(0);
+    }
+    data = ent->lho_off + LH_BASE_SIZE + get2bytes(lh+26) + get2bytes(lh+28);
+    room = next_offset(&ss->ol,ent->lho_off) - data;
+    if (room <= (off_t) ent->csize + (ent->flags & FLAG_DESCRIPTOR ? 24 : 0)) {
+        return(0);
+    }
+
+    for (i = 0; i < (ent->flags & FLAG_DESCRIPTOR ? 4 : 1); i++) {
+        diff = room - ent->csize - (ent->flags & FLAG_DESCRIPTOR ? ddlen[i] : 0);
+        if (diff > 0 && diff % WRAP == 0) {
+            break;
+        }
+    }
+    if (i == (ent->flags & FLAG_DESCRIPTOR ? 4 : 1)) {
+        return(0);
+    }
+
+    /* A candidate: check the data really is that long */
+    if ((r = measure_entry(ss->fd,data,ent->csize + diff,ent->method,
+            &usize,&crc)) < 0) {
+        snprintf(errbuf,ERRMAX,"Failed to read entry %llu: %s",ent->index,
+                strerror(errno));
+        return(-1);
+    }
+    if (r || crc != ent->crc ||
+            (usize != ent->usize && usize % WRAP != ent->usize)) {
+        ss->bad++;
+        return(0);
+    }
+
+    if (ss->nrepairs == ss->maxrepairs) {
+        ss->maxrepairs = ss->maxrepairs ? ss->maxrepairs * 2 : 16;
+        if ((p = realloc(ss->repairs,ss->maxrepairs * sizeof(*p))) == NULL) {
+            snprintf(errbuf,ERRMAX,"Out of memory");
+            return(-1);
+        }
+        ss->repairs = p;
+    }
+    p = &ss->repairs[ss->nrepairs++];
+    p->index = ent->index;
+    p->csize = ent->csize + diff;
+    p->usize = usize;
+    return(0);
+}
+
+/* rewrite_cd() edit callback for fixsizes(): apply the repairs */
+int apply_size(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct size_scan *ss = arg;
+
+    (void) errbuf;
+    if (ss->next < ss->nrepairs && ss->repairs[ss->next].index == ent->index) {
+        ent->csize = ss->repairs[ss->next].csize;
+        ent->usize = ss->repairs[ss->next].usize;
+        ss->next++;
+        return(1);
+    }
+    return(0);
+}
+
+/* Repair entries over 4GB whose sizes have been stored modulo 2^32 by a
+   writer which doesn't know about Zip64.
+
+   Such an entry is spotted because its data runs on, to the next local
+   header (or the central directory), a multiple of 4GB (plus the size of
+   any data descriptor) further than its compressed size says.  Only the
+   data of those entries is read: it is decompressed to find the real
+   uncompressed size and to check the CRC, and if that agrees with the
+   central directory, the directory is rewritten with Zip64 extra fields
+   holding the real sizes.  Local headers are left alone.
+
+   return values: -1: error, or suspect entries which couldn't be repaired
+                   0: nothing to repair
+                   1: entries repaired (or would have been if not dryrun)
+*/
+int fixsizes(char *filename, char **err, int flags)
+{
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    struct size_scan ss;
+    long long n;
+    off_t dead = 0;
+    int fd,res;
+    size_t len;
+
+    *errbuf = '\0';
+    *err = errbuf;
+    memset(&ss,0,sizeof(ss));
+
+    if ((fd = open_archive(filename,&zt,flags,errbuf)) < 0) {
+        return(-1);
+    }
+    ss.fd = fd;
+    ss.zt = &zt;
+    ss.ol.end = zt.cd_off;
+
+    n = cd_walk(fd,&zt,collect_offset,&ss,errbuf);
+    if (n >= 0) {
+        qsort(ss.ol.offsets,ss.ol.n,sizeof(*ss.ol.offsets),cmp_offset);
+        n = cd_walk(fd,&zt,find_truncated,&ss,errbuf);
+    }
+    if (n >= 0 && ss.nrepairs) {
+        n = rewrite_cd(fd,&zt,apply_size,&ss,flags,&dead,errbuf);
+    }
+    (void) close(fd);
+    free(ss.ol.offsets);
+    free(ss.repairs);
+    if (n < 0) {
+        return(-1);
+    }
+
+    res = ss.bad ? -1 : ss.nrepairs ? 1 : 0;
+    if (ss.nrepairs) {
+        snprintf(errbuf,ERRMAX,"Sizes of %llu entries repaired",ss.nrepairs);
+    } else {
+        snprintf(errbuf,ERRMAX,"No truncated sizes found");
+    }
+    len = strlen(errbuf);
+    if (ss.bad) {
+        snprintf(errbuf+len,ERRMAX-len,"; %llu suspect entries don't check out",
+                ss.bad);
+    } else if (dead) {
+        snprintf(errbuf+len,ERRMAX-len,"; %lld bytes of dead space left",
+                (long long) dead);
+    }
+    return(res);
+}
+
+/* An entry whose local header isn't where the central directory says */
+struct offset_suspect {
+    unsigned long long index;       /* Entry number */
+    unsigned long long off;         /* Offset from the central directory */
+    unsigned long long found;       /* Where its local header really is */
+    int nfound;                     /* Number of places it might be */
+    size_t name;                    /* Offset of its name in the arena */
+    unsigned short name_len;
+};
+
+/* State shared by fixoffsets()'s callbacks */
+struct offset_scan {
+    int fd;
+    const struct zip_trailer *zt;
+    struct offset_suspect *suspects;
+    unsigned long long nsuspects;
+    unsigned long long maxsuspects;
+    unsigned long long next;        /* Next suspect to apply */
+    unsigned char *names;           /* Arena holding suspects' names */
+    size_t names_len;
+    size_t names_max;
+    unsigned char lh[LH_BASE_SIZE + 0xffff];
+};
+
+/* Check whether there is a local header for an entry called name at off.
+   Returns 1 if so, 0 if not, -1 on read error (other than end of file) */
+int local_header_at(struct offset_scan *os, off_t off,
+        const unsigned char *name, unsigned short name_len)
+{
+    if (readat(os->fd,os->lh,LH_BASE_SIZE + name_len,off)) {
+        return(errno == EIO ? 0 : -1);
+    }
+    return(get4bytes(os->lh) == LH_SIG && get2bytes(os->lh+26) == name_len &&
+            memcmp(os->lh+LH_BASE_SIZE,name,name_len) == 0);
+}
+
+/* cd_walk() callback for fixoffsets(): note entries without a Zip64
+   offset whose local header isn't where the central directory says */
+int find_misplaced(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct offset_scan *os = arg;
+    struct offset_suspect *sp;
+    unsigned char *p;
+    int r;
+
+    if (get4bytes(ent->hdr+42) == 0xffffffff || os->zt->cd_off < WRAP) {
+        return(0);
+    }
+    if ((r = local_header_at(os,ent->lho_off,ent->name,ent->name_len)) != 0) {
+        if (r < 0) {
+            snprintf(errbuf,ERRMAX,"Failed to read local header for entry "
+                    "%llu: %s",ent->index,strerror(errno));
+        }
+        return(r < 0 ? -1 : 0);
+    }
+
+    if (os->nsuspects == os->maxsuspects) {
+        os->maxsuspects = os->maxsuspects ? os->maxsuspects * 2 : 1024;
+        if ((sp = realloc(os->suspects,os->maxsuspects * sizeof(*sp)))
+                == NULL) {
+            goto nomem;
+        }
+        os->suspects = sp;
+    }
+    while (os->names_len + ent->name_len > os->names_max) {
+        os->names_max = os->names_max ? os->names_max * 2 : 65536;
+        if ((p = realloc(os->names,os->names_max)) == NULL) {
+            goto nomem;
+        }
+        os->names = p;
+    }
+
+    sp = &os->suspects[os->nsuspects++];
+    sp->index = ent->index;
+    sp->off = ent->lho_off;
+    sp->nfound = 0;
+    sp->name = os->names_len;
+    sp->name_len = ent->name_len;
+    memcpy(os->names+os->names_len,ent->name,ent->name_len);
+    os->names_len += ent->name_len;
+    return(0);
+
+nomem:
+    snprintf(errbuf,ERRMAX,"Out of memory");
+    return(-1);
+}
+
+/* rewrite_cd() edit callback for fixoffsets(): apply the repairs */
+int apply_offset(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct offset_scan *os = arg;
+    struct offset_suspect *sp;
+
+    (void) errbuf;
+    while (os->next < os->nsuspects &&
+            os->suspects[os->next].index <= ent->index) {
+        sp = &os->suspects[os->next++];
+        if (sp->index == ent->index && sp->nfound == 1) {
+            ent->lho_off = sp->found;
+            return(1);
+        }
+    }
+    return(0);
+}
+
+/* Repair entries whose local header offsets are beyond 4GB but have been
+   stored modulo 2^32 by a writer which doesn't know about Zip64.
+
+   Entries whose local header isn't where the central directory says are
+   looked for 4GB, 8GB... further on, up to the central directory, by
+   checking for a local header signature followed by the entry's name.
+   This costs a few small reads per entry rather than a scan of the
+   archive.  Where the system allows, we first tell it about every read
+   we are going to make so that it can issue them together.  Entries found
+   in exactly one place have their offsets corrected in a rewritten
+   central directory with Zip64 extra fields.
+
+   return values: -1: error, or entries which couldn't be found
+                   0: nothing to repair
+                   1: entries repaired (or would have been if not dryrun)
+*/
+int fixoffsets(char *filename, char **err, int flags)
+{
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    static struct offset_scan os;
+    struct offset_suspect *sp;
+    unsigned long long i,fixed = 0,lost = 0;
+    long long n;
+    off_t dead = 0,off;
+    int fd,r;
+    size_t len;
+
+    *errbuf = '\0';
+    *err = errbuf;
+
+    if ((fd = open_archive(filename,&zt,flags,errbuf)) < 0) {
+        return(-1);
+    }
+    os.fd = fd;
+    os.zt = &zt;
+    os.nsuspects = os.next = 0;
+    os.names_len = 0;
+
+    n = cd_walk(fd,&zt,find_misplaced,&os,errbuf);
+
+#ifdef POSIX_FADV_WILLNEED
+    for (i = 0; n >= 0 && i < os.nsuspects; i++) {
+        sp = &os.suspects[i];
+        for (off = sp->off + WRAP; off < zt.cd_off; off += WRAP) {
+            (void) posix_fadvise(fd,off,LH_BASE_SIZE + sp->name_len,
+                    POSIX_FADV_WILLNEED);
+        }
+    }
+#endif
+
+    for (i = 0; n >= 0 && i < os.nsuspects; i++) {
+        sp = &os.suspects[i];
+        for (off = sp->off + WRAP; off < zt.cd_off; off += WRAP) {
+            if ((r = local_header_at(&os,off,os.names+sp->name,
+                    sp->name_len)) < 0) {
+                snprintf(errbuf,ERRMAX,"Failed to read %s: %s",filename,
+                        strerror(errno));
+                n = -1;
+                break;
+            }
+            if (r) {
+                sp->found = off;
+                sp->nfound++;
+            }
+        }
+        if (sp->nfound == 1) {
+            fixed++;
+        } else {
+            lost++;
+        }
+    }
+
+    if (n >= 0 && fixed) {
+        n = rewrite_cd(fd,&zt,apply_offset,&os,flags,&dead,errbuf);
+    }
+    (void) close(fd);
+    if (n < 0) {
+        return(-1);
+    }
+
+    if (fixed) {
+        snprintf(errbuf,ERRMAX,"Offsets of %llu entries repaired",fixed);
+    } else {
+        snprintf(errbuf,ERRMAX,"No misplaced local headers found");
+    }
+    len = strlen(errbuf);
+    if (lost) {
+        snprintf(errbuf+len,ERRMAX-len,"; %llu local headers not found",lost);
+    } else if (dead) {
+        snprintf(errbuf+len,ERRMAX-len,"; %lld bytes of dead space left",
+                (long long) dead);
+    }
+    return(lost ? -1 : fixed ? 1 : 0);
+}
+
+/* Find the start of a central directory which ends at end, by working
+   backwards from there: the entry before any entry (or the end) must start
+   with a central directory signature and be exactly long enough to reach
+   it.  Returns the offset of the first entry (end if there are none), or
+   -1 on read error */
+off_t find_cd_start(int fd, off_t end)
+{
+    static unsigned char buf[CD_WINDOW];
+    off_t bufoff = end,head = end;
+    size_t n;
+    unsigned char *ptr;
+
+    for (;;) {
+        /* Keep the CD_MAX_ENTRY bytes before the current head in buf */
+        if (head - bufoff < CD_BASE_SIZE ||
+                (bufoff > 0 && head - bufoff < CD_MAX_ENTRY)) {
+            bufoff = head > CD_WINDOW ? head - CD_WINDOW : 0;
+            n = head - bufoff;
+            if (n < CD_BASE_SIZE) {
+                return(head);
+            }
+            if (readat(fd,buf,n,bufoff)) {
+                return(-1);
+            }
+        }
+
+        for (ptr = buf + (head - bufoff) - CD_BASE_SIZE; ptr >= buf &&
+                buf + (head - bufoff) - ptr <= CD_MAX_ENTRY; --ptr) {
+            if (get4bytes(ptr) == CD_SIG && ptr + CD_BASE_SIZE +
+                    get2bytes(ptr+28) + get2bytes(ptr+30) + get2bytes(ptr+32)
+                    == buf + (head - bufoff)) {
+                break;
+            }
+        }
+        if (ptr < buf || buf + (head - bufoff) - ptr > CD_MAX_ENTRY) {
+            return(head);
+        }
+        head = bufoff + (ptr - buf);
+    }
+}
+
+/* cd_walk() callback for fixz64(): just count entries */
+int count_entry(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    (void) ent;
+    (void) arg;
+    (void) errbuf;
+    return(0);
+}
+
+/* Add the Zip64 EOCDR and EOCDL to a zip file whose EOCDR says that they
+   are needed (some fields are all ones) but which doesn't have them.
+
+   The central directory must end where the EOCDR starts, so we find its
+   start by working backwards through it from there, then walk forwards
+   through it to check it and count its entries.  As the Zip64 records must
+   follow the central directory, which is followed by the old EOCDR, the
+   central directory is copied to the end of the file and switched to with
+   switch_trailer().  The old central directory is left as dead space.
+   Where the EOCDR holds real values rather than all ones, they must match
+   what we find.  Zip64 records are written even if the values would fit
+   without them, as the writer meant them to be there.
+
+   return values: -1: error
+                   0: file doesn't need updating
+                   1: file updated (or would have been if not dryrun)
+*/
+int fixz64(char *filename, char **err, int flags)
+{
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    long long n;
+    unsigned long long eocdr_entries;
+    off_t dead = 0,eocdr_size,trailing;
+    int fd;
+    size_t len;
+
+    *errbuf = '\0';
+    *err = errbuf;
+
+    if ((fd = open(filename,(flags & FIX_DRYRUN)?O_RDONLY:O_RDWR)) < 0) {
+        snprintf(errbuf,ERRMAX,"Failed to open %s: %s",
+                filename,strerror(errno));
+        return(-1);
+    }
+    zt.z64_missing = 0;
+    if (read_trailer(fd,&zt,flags,errbuf) == 0) {
+        (void) close(fd);
+        snprintf(errbuf,ERRMAX,"Zip64 end records not needed or present");
+        return(0);
+    }
+    if (!zt.z64_missing) {
+        (void) close(fd);
+        return(-1);
+    }
+    eocdr_entries = zt.entries;
+    eocdr_size = zt.cd_size;
+
+    if ((zt.cd_off = find_cd_start(fd,zt.eocdr_off)) < 0) {
+        snprintf(errbuf,ERRMAX,"Failed to read %s: %s",filename,
+                strerror(errno));
+        (void) close(fd);
+        return(-1);
+    }
+    zt.cd_size = zt.eocdr_off - zt.cd_off;
+    zt.entries = 0;
+    if (zt.cd_size == 0 ||
+            (n = cd_walk(fd,&zt,count_entry,NULL,errbuf)) < 0) {
+        if (!*errbuf) {
+            snprintf(errbuf,ERRMAX,"Central directory not found");
+        }
+        (void) close(fd);
+        return(-1);
+    }
+    zt.entries = n;
+    if ((eocdr_entries != 0xffff && eocdr_entries != zt.entries) ||
+            (eocdr_size != 0xffffffff && eocdr_size != zt.cd_size)) {
+        snprintf(errbuf,ERRMAX,"Central directory has %llu entries in %lld "
+                "bytes, EOCDR says %llu in %lld",zt.entries,
+                (long long) zt.cd_size,eocdr_entries,(long long) eocdr_size);
+        (void) close(fd);
+        return(-1);
+    }
+
+    /* Make build_trailer() write Zip64 records */
+    zt.z64_eocdr_off = zt.eocdr_off;
+
+    /* fixup() can't have removed bytes after an EOCDR like this one, so
+       do it here if asked */
+    if ((trailing = zt.trailing) && (flags & FIX_TRUNCATE)) {
+        if (!(flags & FIX_DRYRUN) && ftruncate(fd,zt.fsize - trailing)) {
+            snprintf(errbuf,ERRMAX,"Failed to truncate %s: %s",filename,
+                    strerror(errno));
+            (void) close(fd);
+            return(-1);
+        }
+        zt.fsize -= trailing;
+        zt.trailing = 0;
+    }
+
+    if (!(flags & FIX_DRYRUN)) {
+        if (copy_range(fd,zt.cd_off,zt.fsize,zt.cd_size)) {
+            snprintf(errbuf,ERRMAX,"Failed to copy central directory: %s",
+                    strerror(errno));
+            (void) ftruncate(fd,zt.fsize);
+            (void) close(fd);
+            return(-1);
+        }
+        if ((dead = switch_trailer(fd,&zt,zt.fsize,zt.cd_size,zt.entries,
+                flags & FIX_KEEPDEAD,errbuf)) < 0) {
+            (void) close(fd);
+            return(-1);
+        }
+    }
+    (void) close(fd);
+
+    snprintf(errbuf,ERRMAX,"Zip64 end records added for %llu entries",
+            zt.entries);
+    if (trailing && (flags & FIX_TRUNCATE)) {
+        len = strlen(errbuf);
+        snprintf(errbuf+len,ERRMAX-len,"; %lld trailing bytes removed",
+                (long long) trailing);
+    }
+    if (dead) {
+        len = strlen(errbuf);
+        snprintf(errbuf+len,ERRMAX-len,"; %lld bytes of dead space left",
+                (long long) dead);
+    }
+    return(1);
+}
+
+/* An entry followed by a data descriptor, and what the central directory
+   says should be in it */
+struct dd_entry {
+    unsigned long long lho_off;     /* Local header offset */
+    unsigned long long csize;
+    unsigned long long usize;
+    unsigned crc;
+};
+
+/* State shared by fixdescriptors()'s cd_walk() callback */
+struct dd_scan {
+    struct offset_list ol;          /* Where each local header is */
+    struct dd_entry *entries;       /* Entries with data descriptors */
+    unsigned long long n;
+    unsigned long long max;
+};
+
+/* qsort() comparison for dd_entry by offset */
+int cmp_dd_entry(const void *a, const void *b)
+{
+    return(cmp_offset(&((const struct dd_entry *) a)->lho_off,
+            &((const struct dd_entry *) b)->lho_off));
+}
+
+/* cd_walk() callback for fixdescriptors(): note where each local header
+   is, and which entries have data descriptors */
+int collect_dd_entry(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct dd_scan *ds = arg;
+    struct dd_entry *p;
+
+    if (add_offset(&ds->ol,ent->lho_off,errbuf)) {
+        return(-1);
+    }
+    if (!(ent->flags & FLAG_DESCRIPTOR)) {
+        return(0);
+    }
+    if (ds->n == ds->max) {
+        ds->max = ds->max ? ds->max * 2 : 1024;
+        if ((p = realloc(ds->entries,ds->max * sizeof(*p))) == NULL) {
+            snprintf(errbuf,ERRMAX,"Out of memory");
+            return(-1);
+        }
+        ds->entries = p;
+    }
+    p = &ds->entries[ds->n++];
+    p->lho_off = ent->lho_off;
+    p->csize = ent->csize;
+    p->usize = ent->usize;
+    p->crc = ent->crc;
+    return(0);
+}
+
+/* Repair data descriptors whose layout is inconsistent with their entry:
+   4 byte sizes in an entry whose local header has a Zip64 extra field (or
+   8 byte ones in one without), a missing signature (which strict streaming
+   extractors need), or values which don't match the central directory.
+
+   Local headers and descriptors are read in file order, each entry in one
+   read if it's small.  Where the system allows, we first tell it about
+   every read we're going to make so that it can issue them together.  A
+   descriptor is only rewritten (with a signature, and values from the
+   central directory) if the correct layout is exactly the size of the
+   space between the entry's data and whatever follows it, so that nothing
+   has to move.  The one layout fault which can be repaired like this is
+   a 16 byte descriptor in an entry with a needless Zip64 extra field in
+   its local header, which is made padding.  Others (missing signatures,
+   and 8 byte sizes where 4 are wanted) can't be without moving data, so
+   they are counted and reported.
+
+   return values: -1: error
+                   0: nothing repaired
+                   1: descriptors repaired (or would have been if not dryrun)
+*/
+int fixdescriptors(char *filename, char **err, int flags)
+{
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    static unsigned char buf[DD_COALESCE + LH_BASE_SIZE + 0x1ffff];
+    struct dd_scan ds;
+    struct dd_entry *de;
+    unsigned char *lh,*z64,dd[DD_MAX],want[DD_MAX],pad[2];
+    unsigned long long i,fixed = 0,stuck = 0;
+    unsigned short name_len,extra_len,z64len;
+    off_t next,data,room;
+    size_t len,span,wantlen;
+    int fd,res = 0,wide,retag;
+
+    *errbuf = '\0';
+    *err = errbuf;
+    memset(&ds,0,sizeof(ds));
+
+    if ((fd = open_archive(filename,&zt,flags,errbuf)) < 0) {
+        return(-1);
+    }
+    ds.ol.end = zt.cd_off;
+    if (cd_walk(fd,&zt,collect_dd_entry,&ds,errbuf) < 0) {
+        res = -1;
+        goto done;
+    }
+    qsort(ds.ol.offsets,ds.ol.n,sizeof(*ds.ol.offsets),cmp_offset);
+    qsort(ds.entries,ds.n,sizeof(*ds.entries),cmp_dd_entry);
+
+#ifdef POSIX_FADV_WILLNEED
+    for (i = 0; i < ds.n; i++) {
+        de = &ds.entries[i];
+        next = next_offset(&ds.ol,de->lho_off);
+        if (next - (off_t) de->lho_off <= DD_COALESCE) {
+            (void) posix_fadvise(fd,de->lho_off,next - de->lho_off,
+                    POSIX_FADV_WILLNEED);
+        } else {
+            (void) posix_fadvise(fd,de->lho_off,LH_BASE_SIZE,
+                    POSIX_FADV_WILLNEED);
+            (void) posix_fadvise(fd,next - DD_MAX,DD_MAX,POSIX_FADV_WILLNEED);
+        }
+    }
+#endif
+
+    for (i = 0; i < ds.n; i++) {
+        de = &ds.entries[i];
+        next = next_offset(&ds.ol,de->lho_off);
+
+        /* Read the local header, and the whole entry if it's small */
+        span = next - (off_t) de->lho_off <= DD_COALESCE ?
+                (size_t) (next - de->lho_off) : LH_BASE_SIZE;
+        if (span < LH_BASE_SIZE || readat(fd,buf,span,de->lho_off) ||
+                get4bytes(buf) != LH_SIG) {
+            stuck++;
+            continue;
+        }
+        name_len = get2bytes(buf+26);
+        extra_len = get2bytes(buf+28);
+        if (span < (size_t) LH_BASE_SIZE + name_len + extra_len &&
+                readat(fd,buf+LH_BASE_SIZE,name_len + extra_len,
+                de->lho_off + LH_BASE_SIZE)) {
+            stuck++;
+            continue;
+        }
+        lh = buf;
+        data = de->lho_off + LH_BASE_SIZE + name_len + extra_len;
+        room = next - data - de->csize;
+        if (room < 12) {
+            stuck++;
+            continue;
+        }
+
+        /* What the descriptor should be */
+        z64 = find_extra(lh+LH_BASE_SIZE+name_len,extra_len,Z64_EXTRA_ID,
+                &z64len);
+        wide = z64 != NULL || de->csize >= 0xffffffff ||
+                de->usize >= 0xffffffff;
+        put4bytes(want,DD_SIG);
+        put4bytes(want+4,de->crc);
+        if (wide) {
+            put8bytes(want+8,de->csize);
+            put8bytes(want+16,de->usize);
+            wantlen = 24;
+        } else {
+            put4bytes(want+8,de->csize);
+            put4bytes(want+12,de->usize);
+            wantlen = 16;
+        }
+
+        /* ...and what it is */
+        len = room > DD_MAX ? DD_MAX : room;
+        if (span > LH_BASE_SIZE) {
+            memcpy(dd,buf + (data - de->lho_off) + de->csize,len);
+        } else if (readat(fd,dd,len,data + de->csize)) {
+            stuck++;
+            continue;
+        }
+        if (len >= wantlen && memcmp(dd,want,wantlen) == 0) {
+            continue;
+        }
+
+        /* A 16 byte descriptor in an entry whose local header has a Zip64
+           extra field it doesn't need (its sizes fit in 32 bits and aren't
+           in the extra field): the descriptor can keep its size if the
+           extra field is turned into padding, as fixnames() does */
+        retag = 0;
+        if (room == 16 && wantlen == 24 && z64 != NULL &&
+                de->csize < 0xffffffff && de->usize < 0xffffffff &&
+                get4bytes(lh+18) != 0xffffffff &&
+                get4bytes(lh+22) != 0xffffffff) {
+            put4bytes(want+8,de->csize);
+            put4bytes(want+12,de->usize);
+            wantlen = 16;
+            retag = 1;
+        }
+        if (room != (off_t) wantlen) {
+            stuck++;
+            continue;
+        }
+
+        /* The descriptor goes first: the local header is only changed
+           once it's there */
+        put2bytes(pad,PAD_EXTRA_ID);
+        if (!(flags & FIX_DRYRUN) &&
+                (writeat(fd,want,wantlen,data + de->csize) || (retag &&
+                writeat(fd,pad,2,de->lho_off + (z64 - 4 - lh))))) {
+            snprintf(errbuf,ERRMAX,"Failed to write %s: %s",filename,
+                    strerror(errno));
+            res = -1;
+            goto done;
+        }
+        fixed++;
+    }
+
+    res = fixed ? 1 : 0;
+    if (fixed) {
+        snprintf(errbuf,ERRMAX,"%llu data descriptors repaired",fixed);
+    } else {
+        snprintf(errbuf,ERRMAX,"No data descriptors to repair");
+    }
+    if (stuck) {
+        len = strlen(errbuf);
+        snprintf(errbuf+len,ERRMAX-len,"; %llu can't be repaired in place",
+                stuck);
+    }
+
+done:
+    (void) close(fd);
+    free(ds.ol.offsets);
+    free(ds.entries);
+    return(res);
+}
+
+/* Apply the rename rules to the len byte name at name, putting the result
+   in out (which must have room for 0xffff bytes) and its length in
+   *out_len.  Returns 1 if the name changes, 0 if not and -1 if the new
+   name would be too long */
+int rename_name(const unsigned char *name, unsigned short len,
+        unsigned char *out, unsigned short *out_len)
+{
+    static unsigned char tmp[0xffff];
+    const unsigned char *src = name;
+    unsigned short i;
+    int r;
+
+    if (rename_backslashes) {
+        for (i = 0; i < len; i++) {
+            tmp[i] = name[i] == '\\' ? '/' : name[i];
+        }
+        src = tmp;
+    }
+
+    for (r = 0; r < nrename_rules; r++) {
+        if (rename_rules[r].from_len <= len &&
+                memcmp(src,rename_rules[r].from,rename_rules[r].from_len) == 0) {
+            break;
+        }
+    }
+    if (r < nrename_rules) {
+        if (len - rename_rules[r].from_len + rename_rules[r].to_len > 0xffff) {
+            return(-1);
+        }
+        memcpy(out,rename_rules[r].to,rename_rules[r].to_len);
+        memcpy(out + rename_rules[r].to_len,src + rename_rules[r].from_len,
+                len - rename_rules[r].from_len);
+        *out_len = len - rename_rules[r].from_len + rename_rules[r].to_len;
+    } else {
+        memcpy(out,src,len);
+        *out_len = len;
+    }
+    return(*out_len != len || memcmp(out,name,len) != 0);
+}
+
+/* State for fixnames()'s rewrite_cd() edit callback */
+struct rename_scan {
+    int fd;
+    int flags;
+    unsigned long long skipped;     /* Entries we couldn't rename */
+    FILE *patches;                  /* Local header changes to make */
+    unsigned char name[0xffff];     /* New name of current entry */
+    unsigned char extra[0xffff];    /* New extra fields of current entry */
+    unsigned char lh[LH_BASE_SIZE + 0x1ffff];
+};
+
+/* Queue a change of len bytes at off in a temporary file, to be made by
+   apply_patches().  Returns 0 or -1 */
+int queue_patch(struct rename_scan *rs, off_t off, const unsigned char *data,
+        unsigned len)
+{
+    long long where = off;
+
+    if ((rs->patches == NULL && (rs->patches = tmpfile()) == NULL) ||
+            fwrite(&where,sizeof(where),1,rs->patches) != 1 ||
+            fwrite(&len,sizeof(len),1,rs->patches) != 1 ||
+            fwrite(data,1,len,rs->patches) != len) {
+        return(-1);
+    }
+    return(0);
+}
+
+/* Make the local header changes queued by queue_patch() and sync them.
+   Returns 0, or -1 with a message in errbuf */
+int apply_patches(struct rename_scan *rs, char *errbuf)
+{
+    long long where;
+    unsigned len;
+
+    if (rs->patches == NULL) {
+        return(0);
+    }
+    if (fflush(rs->patches) || fseeko(rs->patches,0,SEEK_SET)) {
+        goto tmpfail;
+    }
+    while (fread(&where,sizeof(where),1,rs->patches) == 1) {
+        if (fread(&len,sizeof(len),1,rs->patches) != 1 ||
+                len > sizeof(rs->lh) ||
+                fread(rs->lh,1,len,rs->patches) != len) {
+            goto tmpfail;
+        }
+        if (writeat(rs->fd,rs->lh,len,where)) {
+            snprintf(errbuf,ERRMAX,"Failed to update local header at %lld: "
+                    "%s",where,strerror(errno));
+            return(-1);
+        }
+    }
+    if (ferror(rs->patches)) {
+        goto tmpfail;
+    }
+    if (fsync(rs->fd)) {
+        snprintf(errbuf,ERRMAX,"Failed to sync local headers: %s",
+                strerror(errno));
+        return(-1);
+    }
+    return(0);
+
+tmpfail:
+    snprintf(errbuf,ERRMAX,"Failed to read temporary file: %s",
+            strerror(errno));
+    return(-1);
+}
+
+/* rewrite_cd() edit callback for fixnames(): rename an entry in the
+   central directory, and queue the change to its local header, if that can
+   be made in place */
+int rename_entry(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct rename_scan *rs = arg;
+    unsigned char *lh = rs->lh,*extra;
+    unsigned short name_len,lh_name_len,lh_extra_len,flen,pad;
+    unsigned char *field;
+    unsigned len = 0,pos;
+    int r;
+
+    if ((r = rename_name(ent->name,ent->name_len,rs->name,&name_len)) <= 0) {
+        rs->skipped += (r < 0);
+        return(0);
+    }
+
+    /* The local header has to be the same size afterwards.  A name which
+       is at least 4 bytes shorter is followed by a padding extra field to
+       make up the difference */
+    if (readat(rs->fd,lh,LH_BASE_SIZE,ent->lho_off)) {
+        goto fail;
+    }
+    lh_name_len = get2bytes(lh+26);
+    lh_extra_len = get2bytes(lh+28);
+    pad = lh_name_len - name_len;
+    if (get4bytes(lh) != LH_SIG || lh_name_len != ent->name_len ||
+            (name_len > lh_name_len) || (pad > 0 && pad < 4) ||
+            lh_extra_len + pad > 0xffff) {
+        rs->skipped++;
+        return(0);
+    }
+    if (readat(rs->fd,lh+LH_BASE_SIZE,lh_name_len + lh_extra_len,
+            ent->lho_off + LH_BASE_SIZE)) {
+        goto fail;
+    }
+    if (memcmp(lh+LH_BASE_SIZE,ent->name,ent->name_len) != 0) {
+        rs->skipped++;
+        return(0);
+    }
+
+    /* Build the new local header from the lengths on, turning any Unicode
+       Path field (which holds the old name) into padding */
+    extra = lh + LH_BASE_SIZE + lh_name_len;
+    pos = 0;
+    while ((field = next_extra(extra,lh_extra_len,&pos,&flen)) != NULL) {
+        if (get2bytes(field) == UPATH_EXTRA_ID) {
+            put2bytes(field,PAD_EXTRA_ID);
+        }
+    }
+    memcpy(lh + LH_BASE_SIZE,rs->name,name_len);
+    if (pad) {
+        put2bytes(lh + LH_BASE_SIZE + name_len,PAD_EXTRA_ID);
+        put2bytes(lh + LH_BASE_SIZE + name_len + 2,pad - 4);
+        memset(lh + LH_BASE_SIZE + name_len + 4,0,pad - 4);
+    }
+    put2bytes(lh+26,name_len);
+    put2bytes(lh+28,lh_extra_len + pad);
+    if (!(rs->flags & FIX_DRYRUN) && queue_patch(rs,ent->lho_off + 26,lh+26,
+            4 + lh_name_len + lh_extra_len)) {
+        snprintf(errbuf,ERRMAX,"Failed to write temporary file: %s",
+                strerror(errno));
+        return(-1);
+    }
+
+    /* The central directory entry gets the new name, without any Unicode
+       Path field (or anything from a field which runs past the end of the
+       extra fields on) */
+    for (pos = len = 0; (field = next_extra(ent->extra,ent->extra_len,&pos,
+            &flen)) != NULL; ) {
+        if (get2bytes(field) != UPATH_EXTRA_ID) {
+            memcpy(rs->extra+len,field,4 + flen);
+            len += 4 + flen;
+        }
+    }
+    ent->name = rs->name;
+    ent->name_len = name_len;
+    ent->extra = rs->extra;
+    ent->extra_len = len;
+    return(1);
+
+fail:
+    snprintf(errbuf,ERRMAX,"Failed to update local header for entry %llu: %s",
+            ent->index,strerror(errno));
+    return(-1);
+}
+
+/* Rename entries according to the rules given with -r and -b.
+
+   This takes one pass through the central directory, which is rewritten
+   (crash-safely, as for -s) with the new names.  The change to each
+   renamed entry's local header is queued in a temporary file in the same
+   pass, and made in place only once the new central directory is in use:
+   the name is overwritten if it is the same length, and followed by a
+   padding extra field if it is at least 4 bytes shorter.  If rewriting the
+   directory fails, no local header has been touched.  If we're interrupted
+   while patching local headers, those not yet done still have their old
+   names, which strict readers reject; running the same rename again can't
+   fix them, as the directory no longer has the old names.  An entry which
+   would need its local header to grow (or shrink by less than 4 bytes)
+   would need its data moved, so it is left alone and counted instead.
+   The time taken depends on the size of the central directory, not of the
+   archive.
+
+   return values: -1: error
+                   0: nothing renamed
+                   1: entries renamed (or would have been if not dryrun)
+*/
+int fixnames(char *filename, char **err, int flags)
+{
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    static struct rename_scan rs;
+    long long n;
+    off_t dead = 0;
+    int fd;
+    size_t len;
+
+    *errbuf = '\0';
+    *err = errbuf;
+
+    if ((fd = open_archive(filename,&zt,flags,errbuf)) < 0) {
+        return(-1);
+    }
+    rs.fd = fd;
+    rs.flags = flags;
+    rs.skipped = 0;
+    rs.patches = NULL;
+    n = rewrite_cd(fd,&zt,rename_entry,&rs,flags,&dead,errbuf);
+    if (n > 0 && apply_patches(&rs,errbuf)) {
+        n = -1;
+    }
+    if (rs.patches) {
+        (void) fclose(rs.patches);
+    }
+    (void) close(fd);
+    if (n < 0) {
+        return(-1);
+    }
+
+    if (n) {
+        snprintf(errbuf,ERRMAX,"%lld entries renamed",n);
+    } else {
+        snprintf(errbuf,ERRMAX,"No entries to rename");
+    }
+    len = strlen(errbuf);
+    if (rs.skipped) {
+        snprintf(errbuf+len,ERRMAX-len,"; %llu can't be renamed in place",
+                rs.skipped);
+    } else if (dead) {
+        snprintf(errbuf+len,ERRMAX-len,"; %lld bytes of dead space left",
+                (long long) dead);
+    }
+    return(n ? 1 : 0);
+}
+
+/* State for fixextras()'s rewrite_cd() edit callback */
+struct strip_scan {
+    unsigned long long saved;       /* Bytes removed */
+    unsigned char extra[0xffff];    /* New extra fields of current entry */
+};
+
+/* rewrite_cd() edit callback for fixextras(): drop extra fields which
+   aren't in the keep list, and anything from a field which runs past the
+   end of the extra fields on */
+int strip_entry(struct cd_entry *ent, void *arg, char *errbuf)
+{
+    struct strip_scan *ss = arg;
+    unsigned char *extra;
+    unsigned short fid,flen;
+    unsigned len = 0,pos;
+    int k;
+
+    (void) errbuf;
+    for (pos = 0; (extra = next_extra(ent->extra,ent->extra_len,&pos,&flen))
+            != NULL; ) {
+        fid = get2bytes(extra);
+        for (k = 0; k < nkeep_extras && keep_extras[k] != fid; k++)
+            ;
+        if (fid == Z64_EXTRA_ID || k < nkeep_extras) {
+            memcpy(ss->extra+len,extra,4 + flen);
+            len += 4 + flen;
+        }
+    }
+    if (len == ent->extra_len) {
+        return(0);
+    }
+    ss->saved += ent->extra_len - len;
+    ent->extra = ss->extra;
+    ent->extra_len = len;
+    return(1);
+}
+
+/* Shrink the central directory by removing extra fields (such as NTFS
+   times, alignment padding and vendor data) whose ids aren't in the list
+   given with -k.  Zip64 extra fields are always kept.  The directory is
+   rewritten in one streaming pass, crash-safely as for -s.  Local headers
+   are left alone.
+
+   return values: -1: error
+                   0: nothing removed
+                   1: fields removed (or would have been if not dryrun)
+*/
+int fixextras(char *filename, char **err, int flags)
+{
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    static struct strip_scan ss;
+    long long n;
+    off_t dead = 0;
+    int fd;
+    size_t len;
+
+    *errbuf = '\0';
+    *err = errbuf;
+
+    if ((fd = open_archive(filename,&zt,flags,errbuf)) < 0) {
+        return(-1);
+    }
+    ss.saved = 0;
+    n = rewrite_cd(fd,&zt,strip_entry,&ss,flags,&dead,errbuf);
+    (void) close(fd);
+    if (n < 0) {
+        return(-1);
+    }
+    if (!n) {
+        snprintf(errbuf,ERRMAX,"No extra fields to remove");
+        return(0);
+    }
 
-static char *progname = "fixmszip";
-static int little_endian;           /* This system's endianness. 1 == litle */
+    snprintf(errbuf,ERRMAX,"%llu bytes (%.1f%%) removed from central "
+            "directory in %lld entries",ss.saved,
+            100.0 * ss.saved / zt.cd_size,n);
+    if (dead) {
+        len = strlen(errbuf);
+        snprintf(errbuf+len,ERRMAX-len,"; %lld bytes of dead space left",
+                (long long) dead);
+    }
+    return(1);
+}
 
-/* Print usage an exit */
-void usage()
+/* State for findentry()'s cd_scan() callback */
+struct lookup {
+    const char *name;
+    size_t name_len;
+    int found;
+    struct cd_entry ent;            /* Copy of the entry when found */
+};
+
+/* cd_scan() callback for findentry(): stop at the entry with the name
+   we want, and only then decode its Zip64 values */
+int lookup_entry(struct cd_entry *ent, void *arg, char *errbuf)
 {
-    fprintf(stderr,"Usage: %s [-vn] zipfile [...]\n",progname);
-    exit(1);
+    struct lookup *lk = arg;
+
+    if (ent->name_len != lk->name_len ||
+            memcmp(ent->name,lk->name,lk->name_len)) {
+        return(0);
+    }
+    if (cd_zip64(ent)) {
+        snprintf(errbuf,ERRMAX,"Bad Zip64 extra field for central "
+                "directory entry %llu",ent->index);
+        return(-1);
+    }
+    lk->ent = *ent;
+    lk->found = 1;
+    return(1);
 }
 
-/* Return 2 little endian bytes as an unsigned short */
-unsigned short get2bytes(const unsigned char* ptr)
+/* Look up the entry named with -e in the central directory, stopping as
+   soon as it is found, and report where it is.  flags are as for fixup().
+   Returns 0 if found, -1 if not (or on error), with a message in *err
+   either way */
+int findentry(char *filename, char **err, int flags)
 {
-    if (little_endian) {
-        return((*(ptr+1) <<8) + *ptr);
+    static char errbuf[ERRMAX];
+    static struct zip_trailer zt;
+    struct lookup lk;
+    long long n;
+    int fd;
+
+    *errbuf = '\0';
+    *err = errbuf;
+
+    if ((fd = open_archive(filename,&zt,flags|FIX_DRYRUN,errbuf)) < 0) {
+        return(-1);
+    }
+    lk.name = lookup_name;
+    lk.name_len = strlen(lookup_name);
+    lk.found = 0;
+    n = cd_scan(fd,&zt,lookup_entry,&lk,1,errbuf);
+    (void) close(fd);
+    if (n < 0) {
+        return(-1);
+    }
+    if (!lk.found) {
+        snprintf(errbuf,ERRMAX,"No entry %s",lookup_name);
+        return(-1);
     }
 
-    return((*ptr <<8) + *(ptr+1));
+    snprintf(errbuf,ERRMAX,"%s is entry %llu: local header at %llu, "
+            "%llu bytes compressed (method %u), %llu bytes uncompressed, "
+            "CRC %08x",lookup_name,lk.ent.index,lk.ent.lho_off,lk.ent.csize,
+            lk.ent.method,lk.ent.usize,lk.ent.crc);
+    return(0);
 }
 
-/* Return 4 little endian bytes as an unsigned int */
-unsigned int get4bytes(const unsigned char *ptr)
+/* Return the time in microseconds for trace spans */
+long long trace_now()
 {
-    int i;
-    unsigned int val=0;
+    struct timespec ts;
 
-    if (little_endian) {
-        for (i = 0; i < 4; i++) {
-            val += *ptr++ <<(8 * i);
+    if (!trace_path) {
+        return(0);
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC,&ts);
+    return((long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* Record a span of work on the current file, started at start, if tracing
+   and the file is being sampled.  file is only given for the span covering
+   the whole file.  When the span buffer fills, every other sampled file's
+   spans are dropped and the sampling interval doubles, so memory and
+   output stay bounded however many files there are */
+void trace_span(const char *name, const char *file, long long start)
+{
+    size_t i,j;
+
+    if (!trace_path || trace_fileno % trace_every) {
+        return;
+    }
+    if (trace_spans == NULL &&
+            (trace_spans = malloc(TRACE_MAX * sizeof(*trace_spans))) == NULL) {
+        fprintf(stderr,"Out of memory: not tracing\n");
+        trace_path = NULL;
+        return;
+    }
+    if (ntrace == TRACE_MAX) {
+        trace_every *= 2;
+        for (i = j = 0; i < ntrace; i++) {
+            if (trace_spans[i].fileno % trace_every) {
+                free(trace_spans[i].file);
+            } else {
+                trace_spans[j++] = trace_spans[i];
+            }
         }
-    } else {
-        for (i = 0; i < 4; i++) {
-            val += *ptr++ <<(8* (3-i));
+        ntrace = j;
+        if (trace_fileno % trace_every) {
+            return;
         }
     }
-    return val;
+    trace_spans[ntrace].name = name;
+    trace_spans[ntrace].file = file ? strdup(file) : NULL;
+    trace_spans[ntrace].fileno = trace_fileno;
+    trace_spans[ntrace].start = start;
+    trace_spans[ntrace].dur = trace_now() - start;
+    ntrace++;
 }
 
 /* Find and patch a problematic Zip64 EOCDL
 
    We do this as follows.
-   * mmap enough of the last part of the file to encompass the Zip64 EOCDL
-     and the EOCDR including the maximum sized comment, and rouded up to the
-     previous page boundary
+   * mmap (read only) enough of the last part of the file to encompass the
+     Zip64 EOCDL and the EOCDR including the maximum sized comment, and
+     rouded up to the previous page boundary
    * Starting from 18 bytes from the end of the file (where the last byte of
      the EOCDR signature would be if there were no comment), look backwards
      through the file for the signature.  If found, check that the comment
@@ -80,25 +2693,40 @@ unsigned int get4bytes(const unsigned char *ptr)
      - That the Zip64 EOCDL signature is where it should be
      - That the Zip64 EOCDL "Total number of disks" field is set to 0
      ...and assuming the "dryrun" option is not set, change number of disks to 1
+     with a single byte pwrite().  The file is only opened for writing if
+     we might patch it
+
+   If FIX_GARBAGE is set in flags, the EOCDR may be followed by other bytes
+   (e.g. padding added by a transfer tool).  Because any signature found in
+   those could be a fluke, an EOCDR which doesn't end the file is only
+   accepted if it is preceded by a Zip64 EOCDL signature, or if its central
+   directory ends where it starts.  The number of trailing bytes is
+   reported, and they are removed if FIX_TRUNCATE is set or added to the
+   zip file comment (if that stays short enough) if FIX_FOLD is set.  All of
+   this is done within the mapped window.
 
     return values: -1: error
                     0: file doesn't need updating
                     1: file updated (or would have been if not dryrun)
 */
-int fixup(char *filename, char **err, int dryrun)
+int fixup(char *filename, char **err, int flags)
 {
-    int fd,i,res=0,pagesize;
-    unsigned char *fptr,*ptr,*minptr;
-    off_t fsize,offsize = 0, pageoff;
+    int fd,i,res=0,pagesize,dryrun = flags & FIX_DRYRUN;
+    unsigned char *fptr,*ptr,*minptr,*eocdr = NULL,newlen[2];
+    off_t fsize,offsize = 0, pageoff, eocdr_off, eocdr_end, trailing = 0;
     struct stat sbuf;
-    unsigned cd_offset,z64sig,numdisks;
+    unsigned cd_offset,cd_size,z64sig,numdisks;
     unsigned short comment_len,this_disk,start_disk;
     const unsigned char sig[] = {0x50,0x4b,0x05,0x06};
+    const unsigned char one = 1;
     static char errbuf[ERRMAX];
+    size_t len;
+    long long tstep,tpatch;
 
     *errbuf = '\0';
     *err = errbuf;
 
+    tstep = trace_now();
     if (lstat(filename,&sbuf)) {
         snprintf(errbuf,ERRMAX,"Failed to stat %s: %s",
                 filename,strerror(errno));
@@ -108,7 +2736,7 @@ int fixup(char *filename, char **err, int dryrun)
     /* If file is smaller than End of Central Directory Record, it can't be
        a zip file (TODO: check for smallest viable zip file */
     if ((fsize = sbuf.st_size) < EOCDR_BASE_SIZE) {
-        snprintf(errbuf,ERRMAX,"%s is not a zip file\n",filename);
+        snprintf(errbuf,ERRMAX,"%s is not a zip file",filename);
         return(-1);
     }
 
@@ -126,19 +2754,21 @@ int fixup(char *filename, char **err, int dryrun)
         offsize = pageoff = 0;
     }
 
-    if ((fd = open(filename,O_RDWR)) < 0) {
+    if ((fd = open(filename,dryrun?O_RDONLY:O_RDWR)) < 0) {
         snprintf(errbuf,ERRMAX,"Failed to open %s: %s",
                 filename,strerror(errno));
         return(-1);
     }
 
-    if ((fptr = (unsigned char *) mmap(NULL,fsize,PROT_READ|PROT_WRITE,
+    if ((fptr = (unsigned char *) mmap(NULL,fsize,PROT_READ,
                 MAP_SHARED,fd,offsize)) == MAP_FAILED) {
         (void) close(fd);
         snprintf(errbuf,ERRMAX,"Failed to mmap %s: %s",
                 filename,strerror(errno));
         return(-1);
     }
+    trace_span("tail read",NULL,tstep);
+    tstep = trace_now();
 
     /* Starting at what would be the last byte of the EOCDR signature were
        there no comment, work backwards through the mmaped part of the file
@@ -150,14 +2780,27 @@ int fixup(char *filename, char **err, int dryrun)
                 /* If we think we've found the signature, check what would
                    then be the comment length field and confirm that offset
                    of the EOCDR, plus length of the EOCDR, plus comment length
-                   are equal to the file size.  If not, signature must be a
-                   fluke: continute searching. */
+                   are equal to the file size (or if we allow trailing
+                   garbage, not greater than it and the surrounding records
+                   look right).  If not, signature must be a fluke: continute
+                   searching. */
                 comment_len = get2bytes(ptr+20);
-                if ((ptr - fptr) - pageoff + EOCDR_BASE_SIZE + comment_len
-                        != fsize) {
-                    i = SIG_LEN;
+                eocdr_off = offsize + (ptr - fptr);
+                eocdr_end = eocdr_off + EOCDR_BASE_SIZE + comment_len;
+                trailing = sbuf.st_size - eocdr_end;
+                if (trailing < 0 || (trailing && !(flags & FIX_GARBAGE))) {
+                    i = 3;
                     continue;
                 }
+                cd_size = get4bytes(ptr+12);
+                cd_offset = get4bytes(ptr+16);
+                if (trailing && get4bytes(ptr-Z64_EOCDL_SIZE) != Z64_EOCDL_SIG
+                        && (cd_offset == 0xffffffff ||
+                        (off_t) cd_offset + cd_size != eocdr_off)) {
+                    i = 3;
+                    continue;
+                }
+                eocdr = ptr;
 
                 /* Here it looks like we've found the EOCDR.  If this disk
                    is not the start disk, we don't do anything */
@@ -171,7 +2814,6 @@ int fixup(char *filename, char **err, int dryrun)
 
                 /* If the central directory offset is not 0xffffffff, there
                    should be no need to patch the Zip64 EOCDL */
-                cd_offset = get4bytes(ptr+16);
                 if (cd_offset != 0xffffffff) {
                     sprintf(errbuf,"Offset <4GB");
                     break;
@@ -180,7 +2822,8 @@ int fixup(char *filename, char **err, int dryrun)
                 /* Check the Zip64 EOCDL signature is where it should be */
                 z64sig = get4bytes(ptr-Z64_EOCDL_SIZE);
                 if (z64sig != Z64_EOCDL_SIG) {
-                    i = SIG_LEN;
+                    eocdr = NULL;
+                    i = 3;
                     continue;
                 }
 
@@ -188,9 +2831,17 @@ int fixup(char *filename, char **err, int dryrun)
                    a dry run, change it to 1 */
                 numdisks = get4bytes(ptr-4);
                 if (numdisks == 0) {
-                    if (!dryrun) {
-                        *(ptr-4) = 1;
+                    tpatch = trace_now();
+                    if (!dryrun && writeat(fd,&one,1,
+                            offsize + (ptr - 4 - fptr)) < 0) {
+                        snprintf(errbuf,ERRMAX,"Failed to write %s: %s",
+                                filename,strerror(errno));
+                        res = -1;
+                        break;
                     }
+                    trace_span("patch",NULL,tpatch);
+                    snprintf(errbuf,ERRMAX,"Zip64 EOCDL disks at offset %lld: "
+                            "0 -> 1",(long long) (offsize + (ptr - 4 - fptr)));
                     res = 1;
                 } else {
                     sprintf(errbuf,"Number of disks already 1");
@@ -205,62 +2856,651 @@ int fixup(char *filename, char **err, int dryrun)
             }
         }
     }
+
+    trace_span("scan",NULL,tstep);      /* Including any patch above */
+
+    /* Report, remove or fold into the comment anything after the EOCDR */
+    if (eocdr && res >= 0 && trailing) {
+        tpatch = trace_now();
+        len = strlen(errbuf);
+        if (flags & FIX_TRUNCATE) {
+            if (!dryrun && ftruncate(fd,eocdr_end)) {
+                snprintf(errbuf,ERRMAX,"Failed to truncate %s: %s",
+                        filename,strerror(errno));
+                res = -1;
+            } else {
+                snprintf(errbuf+len,ERRMAX-len,"%s%lld trailing bytes removed",
+                        len?"; ":"",(long long) trailing);
+                res = 1;
+            }
+        } else if (flags & FIX_FOLD) {
+            put2bytes(newlen,comment_len + trailing);
+            if (comment_len + trailing > MAX_COMMENT) {
+                snprintf(errbuf,ERRMAX,"%lld trailing bytes won't fit in comment",
+                        (long long) trailing);
+                res = -1;
+            } else if (!dryrun && writeat(fd,newlen,2,eocdr_end -
+                    comment_len - 2)) {
+                snprintf(errbuf,ERRMAX,"Failed to write %s: %s",
+                        filename,strerror(errno));
+                res = -1;
+            } else {
+                snprintf(errbuf+len,ERRMAX-len,
+                        "%s%lld trailing bytes added to comment",
+                        len?"; ":"",(long long) trailing);
+                res = 1;
+            }
+        } else {
+            snprintf(errbuf+len,ERRMAX-len,"%s%lld trailing bytes",
+                    len?"; ":"",(long long) trailing);
+        }
+        if (flags & (FIX_TRUNCATE|FIX_FOLD)) {
+            trace_span("patch",NULL,tpatch);
+        }
+    }
+
     (void) munmap(fptr,fsize);
-    if (ptr == minptr) {
+    (void) close(fd);
+    if (ptr < minptr) {
         sprintf(errbuf,"No Zip64 EOCDL found");
     }
     return(res);
 }
 
+/* Print a field of a print_record() line, escaping backslashes and
+   control characters (such as tabs and newlines in file names) so that
+   they can't break up the line */
+void print_field(const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '\\') {
+            fputs("\\\\",stdout);
+        } else if (*s == '\t') {
+            fputs("\\t",stdout);
+        } else if (*s == '\n') {
+            fputs("\\n",stdout);
+        } else if ((unsigned char) *s < 0x20 || *s == 0x7f) {
+            printf("\\x%02x",(unsigned char) *s);
+        } else {
+            putchar(*s);
+        }
+    }
+}
+
+/* Print one tab separated line describing a file and what we did to it,
+   for loading into other tools: file name, result of fixup(), whether the
+   file has Zip64 end records, number of entries, central directory offset
+   and size, and any message from fixup().  The trailer is read afresh, so
+   should be after any other steps which rewrite it.  Trailer fields we
+   can't read are printed as "-".  flags are as for fixup() */
+void print_record(const char *filename, int res, const char *msg, int flags)
+{
+    static struct zip_trailer zt;
+    char errbuf[ERRMAX];
+    int fd,ok = 0;
+
+    if ((fd = open(filename,O_RDONLY)) >= 0) {
+        ok = (read_trailer(fd,&zt,flags,errbuf) == 0);
+        (void) close(fd);
+    }
+
+    print_field(filename);
+    printf("\t%s\t",res==1?"fixed":res==0?"unnecessary":"failed");
+    if (ok) {
+        printf("%d\t%llu\t%lld\t%lld\t",zt.z64_eocdr_off >= 0,zt.entries,
+                (long long) zt.cd_off,(long long) zt.cd_size);
+    } else {
+        printf("-\t-\t-\t-\t");
+    }
+    print_field(msg);
+    putchar('\n');
+    fflush(stdout);
+}
+
+/* Return the next file to work on: the next command line argument, or
+   with -@ (batch set) the next non-empty line of standard input.  Returns
+   NULL when there are no more */
+char *next_file(int argc, char **argv, int *i, int batch)
+{
+    static char line[PATH_MAX+2];
+    size_t len;
+
+    if (!batch) {
+        return(*i < argc ? argv[(*i)++] : NULL);
+    }
+    while (fgets(line,sizeof(line),stdin) != NULL) {
+        len = strlen(line);
+        if (len && line[len-1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len) {
+            return(line);
+        }
+    }
+    return(NULL);
+}
+
+/* Print s as a JSON string.  File names needn't be valid UTF-8, so bytes
+   from 0x80 up are escaped as the code points with the same values, which
+   keeps the output valid JSON and lets the original bytes be recovered */
+void json_string(FILE *fp, const char *s)
+{
+    putc('"',fp);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(fp,"\\%c",*s);
+        } else if ((unsigned char) *s < 0x20 || (unsigned char) *s >= 0x7f) {
+            fprintf(fp,"\\u%04x",(unsigned char) *s);
+        } else {
+            putc(*s,fp);
+        }
+    }
+    putc('"',fp);
+}
+
+/* Write the spans recorded to the file given with -T, in Chrome trace
+   event format (which Perfetto and chrome://tracing load).  Returns 0, or
+   -1 with a message on stderr */
+int trace_write()
+{
+    FILE *fp;
+    size_t i;
+    int pid = getpid();
+
+    if ((fp = fopen(trace_path,"w")) == NULL) {
+        fprintf(stderr,"Failed to open %s: %s\n",trace_path,strerror(errno));
+        return(-1);
+    }
+    fprintf(fp,"{\"traceEvents\":[\n");
+    for (i = 0; i < ntrace; i++) {
+        fprintf(fp,"{\"name\":");
+        json_string(fp,trace_spans[i].name);
+        fprintf(fp,",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld,"
+                "\"dur\":%lld,\"args\":{\"fileno\":%llu",pid,pid,
+                trace_spans[i].start,trace_spans[i].dur,trace_spans[i].fileno);
+        if (trace_spans[i].file) {
+            fprintf(fp,",\"file\":");
+            json_string(fp,trace_spans[i].file);
+        }
+        fprintf(fp,"}}%s\n",i + 1 < ntrace ? "," : "");
+    }
+    fprintf(fp,"],\"otherData\":{\"sampled_every\":%llu}}\n",trace_every);
+    if (fclose(fp)) {
+        fprintf(stderr,"Failed to write %s: %s\n",trace_path,strerror(errno));
+        return(-1);
+    }
+    return(0);
+}
+
+/* Run one of the steps after fixup() (such as checkcd() or fixsizes()) on
+   a file, reporting the result as main() does for fixup().  Returns the
+   result of the step */
+int run_step(int (*step)(char *, char **, int), const char *what,
+        char *filename, int flags, int verbose)
+{
+    char *errmsg;
+    int res;
+    long long start = trace_now();
+
+    if (verbose) {
+        printf("%s %s:...",what,filename);
+    }
+    res = step(filename,&errmsg,flags);
+    if (verbose) {
+        if (res == 1) {
+            printf("Success! %s%s\n",errmsg,
+                    (flags & FIX_DRYRUN)?" (dryrun: no change made)":"");
+        } else if (res == 0) {
+            printf("OK: %s\n",errmsg);
+        } else {
+            printf("Failed\n");
+            fprintf(stderr,"%s\n",errmsg);
+        }
+        fflush(stdout);
+        fflush(stderr);
+    } else if (res < 0) {
+        fprintf(stderr,"%s: %s\n",filename,errmsg);
+    }
+    trace_span(what,NULL,start);
+    return(res);
+}
+
+/* Return a file time in nanoseconds */
+long long time_ns(const struct timespec *ts)
+{
+    return((long long) ts->tv_sec * 1000000000 + ts->tv_nsec);
+}
+
+/* Look up a file in the seen cache.  Returns the entry if the file has
+   already been examined and has not changed since, otherwise NULL */
+struct seen_file *seen_lookup(const struct stat *sbuf)
+{
+    unsigned i;
+
+    for (i = 0; i < nseen; i++) {
+        if (seen[i].dev == sbuf->st_dev && seen[i].ino == sbuf->st_ino &&
+                seen[i].size == sbuf->st_size &&
+                seen[i].mtime == time_ns(&sbuf->ST_MTIM) &&
+                seen[i].ctime == time_ns(&sbuf->ST_CTIM)) {
+            seen[i].used = ++seen_clock;
+            seen_hits++;
+            return(&seen[i]);
+        }
+    }
+    seen_misses++;
+    return(NULL);
+}
+
+/* Remember the result of examining a file, evicting the least recently
+   used entry if the cache is full */
+void seen_add(const struct stat *sbuf, int res, const char *msg)
+{
+    unsigned i,victim = 0;
+    struct seen_file *sf;
+
+    if (nseen < SEEN_MAX) {
+        victim = nseen++;
+    } else {
+        for (i = 1; i < SEEN_MAX; i++) {
+            if (seen[i].used < seen[victim].used) {
+                victim = i;
+            }
+        }
+        free(seen[victim].msg);
+    }
+
+    sf = &seen[victim];
+    sf->dev = sbuf->st_dev;
+    sf->ino = sbuf->st_ino;
+    sf->size = sbuf->st_size;
+    sf->mtime = time_ns(&sbuf->ST_MTIM);
+    sf->ctime = time_ns(&sbuf->ST_CTIM);
+    sf->used = ++seen_clock;
+    sf->res = res;
+    sf->msg = strdup(msg);
+}
+
+/* qsort() and bsearch() comparison for state_file by device and inode */
+int cmp_state(const void *a, const void *b)
+{
+    const struct state_file *x = a, *y = b;
+
+    if (x->dev != y->dev) {
+        return(x->dev < y->dev ? -1 : 1);
+    }
+    return(x->ino < y->ino ? -1 : x->ino > y->ino);
+}
+
+/* qsort() comparison for state_file by device, inode and then the order
+   the entries were added */
+int cmp_state_seq(const void *a, const void *b)
+{
+    const struct state_file *x = a, *y = b;
+    int c;
+
+    if ((c = cmp_state(a,b)) != 0) {
+        return(c);
+    }
+    return(x->seq < y->seq ? -1 : x->seq > y->seq);
+}
+
+/* Look up a file in the state from earlier runs.  Returns the entry if the
+   file was examined with the same flags and has not changed since,
+   otherwise NULL */
+struct state_file *state_lookup(const struct stat *sbuf, int flags)
+{
+    struct state_file key,*st;
+
+    key.dev = sbuf->st_dev;
+    key.ino = sbuf->st_ino;
+    if ((st = bsearch(&key,states,nsorted,sizeof(*states),cmp_state))
+            == NULL || st->size != sbuf->st_size ||
+            st->mtime != time_ns(&sbuf->ST_MTIM) ||
+            st->ctime != time_ns(&sbuf->ST_CTIM) ||
+            st->flags != flags) {
+        return(NULL);
+    }
+    state_hits++;
+    return(st);
+}
+
+/* Remember the result of examining a file for the next run, replacing
+   anything remembered from earlier runs.  Returns 0, or -1 if out of
+   memory */
+int state_add(const struct stat *sbuf, int flags, int res, const char *msg)
+{
+    struct state_file key,*st;
+    char *p;
+
+    key.dev = sbuf->st_dev;
+    key.ino = sbuf->st_ino;
+    if ((st = bsearch(&key,states,nsorted,sizeof(*states),cmp_state))
+            == NULL) {
+        if (nstates == maxstates) {
+            maxstates = maxstates ? maxstates * 2 : 1024;
+            if ((st = realloc(states,maxstates * sizeof(*st))) == NULL) {
+                return(-1);
+            }
+            states = st;
+        }
+        st = &states[nstates];
+        st->dev = key.dev;
+        st->ino = key.ino;
+        st->seq = nstates++;
+    } else {
+        free(st->msg);
+    }
+    st->size = sbuf->st_size;
+    st->mtime = time_ns(&sbuf->ST_MTIM);
+    st->ctime = time_ns(&sbuf->ST_CTIM);
+    st->flags = flags;
+    st->res = res;
+    if ((st->msg = strdup(msg)) == NULL) {
+        return(-1);
+    }
+
+    /* Messages are stored one per line */
+    for (p = st->msg; (p = strchr(p,'\n')) != NULL; ) {
+        *p = ' ';
+    }
+    return(0);
+}
+
+/* Load the state saved by an earlier run from path.  A missing file is
+   not an error: it just means there was no earlier run.  Returns 0, or -1
+   with a message on stderr */
+int state_load(const char *path)
+{
+    FILE *fp;
+    char line[ERRMAX+128],*msg;
+    struct state_file st;
+    int n;
+    size_t len;
+
+    if ((fp = fopen(path,"r")) == NULL) {
+        if (errno == ENOENT) {
+            return(0);
+        }
+        fprintf(stderr,"Failed to open %s: %s\n",path,strerror(errno));
+        return(-1);
+    }
+    if (fgets(line,sizeof(line),fp) == NULL || strcmp(line,STATE_HEADER)) {
+        fprintf(stderr,"%s is not a fixmszip state file\n",path);
+        (void) fclose(fp);
+        return(-1);
+    }
+    while (fgets(line,sizeof(line),fp) != NULL) {
+        len = strlen(line);
+        if (len && line[len-1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (sscanf(line,"%llu %llu %lld %lld %lld %d %d %n",&st.dev,&st.ino,
+                &st.size,&st.mtime,&st.ctime,&st.flags,&st.res,&n) < 7) {
+            fprintf(stderr,"Bad line in state file %s: %s\n",path,line);
+            (void) fclose(fp);
+            return(-1);
+        }
+        msg = line + n;
+        if (nstates == maxstates) {
+            maxstates = maxstates ? maxstates * 2 : 1024;
+            if ((states = realloc(states,maxstates * sizeof(*states)))
+                    == NULL) {
+                fprintf(stderr,"Out of memory\n");
+                (void) fclose(fp);
+                return(-1);
+            }
+        }
+        if ((st.msg = strdup(msg)) == NULL) {
+            fprintf(stderr,"Out of memory\n");
+            (void) fclose(fp);
+            return(-1);
+        }
+        st.seq = nstates;
+        states[nstates++] = st;
+    }
+    (void) fclose(fp);
+
+    qsort(states,nstates,sizeof(*states),cmp_state);
+    nsorted = nstates;
+    return(0);
+}
+
+/* Save the state for the next run to path.  It is written to a temporary
+   file which then replaces path, so an interrupted save leaves the old
+   state intact.  Returns 0, or -1 with a message on stderr */
+int state_save(const char *path)
+{
+    FILE *fp;
+    char *tmp;
+    size_t i,n;
+
+    /* Files added since the load aren't in the sorted part, so the same one
+       (or a hard link to it) may have been added more than once.  Keep only
+       the last entry for each */
+    qsort(states,nstates,sizeof(*states),cmp_state_seq);
+    for (i = n = 0; i < nstates; i++) {
+        if (i + 1 < nstates && !cmp_state(&states[i],&states[i+1])) {
+            free(states[i].msg);
+        } else {
+            states[n++] = states[i];
+        }
+    }
+    nstates = nsorted = n;
+
+    if ((tmp = malloc(strlen(path) + 5)) == NULL) {
+        fprintf(stderr,"Out of memory\n");
+        return(-1);
+    }
+    sprintf(tmp,"%s.tmp",path);
+    if ((fp = fopen(tmp,"w")) == NULL) {
+        fprintf(stderr,"Failed to open %s: %s\n",tmp,strerror(errno));
+        free(tmp);
+        return(-1);
+    }
+    fputs(STATE_HEADER,fp);
+    for (i = 0; i < nstates; i++) {
+        fprintf(fp,"%llu %llu %lld %lld %lld %d %d %s\n",states[i].dev,
+                states[i].ino,states[i].size,states[i].mtime,states[i].ctime,
+                states[i].flags,states[i].res,states[i].msg);
+    }
+    if (fflush(fp) || fsync(fileno(fp)) || fclose(fp) || rename(tmp,path)) {
+        fprintf(stderr,"Failed to save state to %s: %s\n",path,
+                strerror(errno));
+        (void) unlink(tmp);
+        free(tmp);
+        return(-1);
+    }
+    free(tmp);
+    return(0);
+}
+
 int main (int argc, char **argv)
 {
     unsigned problems = 0;
-    int c,i,err,res,verbose = 0,nopatch=0;
+    char *eq,*id,*end,*filename,*statepath = NULL;
+    int c,i,err,res,fixres,verbose = 0,nopatch=0,known,flags=0,records=0,
+        check=0,sizes=0,offsets=0,z64=0,descriptors=0,strip=0,batch=0;
     char *errmsg;
+    struct stat sbuf;
+    struct seen_file *sf;
+    struct state_file *st;
+    long long tfile,tstep;
 
     c = 1;
     little_endian =  *(char *)&c;
 
-    while ((c = getopt(argc,argv,"vn")) != -1) {
+    while ((c = getopt(argc,argv,"vngtfpczsodbr:xk:le:S:T:@")) != -1) {
         switch (c) {
         case 'v':       /* Verbose output */
             verbose++;
             break;
         case 'n':       /* dry run */
             nopatch++;
+            flags |= FIX_DRYRUN;
+            break;
+        case 'g':       /* Allow garbage after the EOCDR */
+            flags |= FIX_GARBAGE;
+            break;
+        case 't':       /* ...and truncate it */
+            flags |= FIX_GARBAGE|FIX_TRUNCATE;
+            break;
+        case 'f':       /* ...or fold it into the zip file comment */
+            flags |= FIX_GARBAGE|FIX_FOLD;
+            break;
+        case 'p':       /* Tab separated record per file */
+            records++;
+            break;
+        case 'c':       /* Check central directory too */
+            check++;
+            break;
+        case 'z':       /* Add missing Zip64 end records */
+            z64++;
+            break;
+        case 's':       /* Repair sizes truncated to 32 bits */
+#ifndef HAVE_ZLIB
+            fprintf(stderr,"%s: -s needs fixmszip built with zlib\n",
+                    progname);
+            exit(1);
+#endif
+            sizes++;
+            break;
+        case 'o':       /* Repair offsets truncated to 32 bits */
+            offsets++;
+            break;
+        case 'd':       /* Repair data descriptors */
+            descriptors++;
+            break;
+        case 'b':       /* Backslashes in names to slashes */
+            rename_backslashes++;
+            break;
+        case 'r':       /* Rename entries starting old to start new */
+            if ((eq = strchr(optarg,'=')) == NULL || eq == optarg ||
+                    nrename_rules == RENAME_MAX) {
+                usage();
+            }
+            rename_rules[nrename_rules].from = optarg;
+            rename_rules[nrename_rules].from_len = eq - optarg;
+            rename_rules[nrename_rules].to = eq + 1;
+            rename_rules[nrename_rules].to_len = strlen(eq + 1);
+            nrename_rules++;
+            break;
+        case 'k':       /* Extra field ids to keep with -x */
+            for (id = strtok(optarg,","); id; id = strtok(NULL,",")) {
+                if (nkeep_extras == KEEP_MAX) {
+                    usage();
+                }
+                keep_extras[nkeep_extras++] = strtoul(id,&end,0);
+                if (*end || end == id) {
+                    usage();
+                }
+            }
+            /* Fall through */
+        case 'x':       /* Remove extra fields from central directory */
+            strip++;
+            break;
+        case 'l':       /* Leave old central directories as dead space */
+            flags |= FIX_KEEPDEAD;
+            break;
+        case 'e':       /* Look up an entry by name */
+            lookup_name = optarg;
+            break;
+        case 'S':       /* Remember results between runs */
+            statepath = optarg;
+            break;
+        case 'T':       /* Write a trace of where time goes */
+            trace_path = optarg;
+            break;
+        case '@':       /* Read file names from standard input */
+            batch++;
             break;
         default:
             usage();
         }
     }
 
-    if (optind == argc) {
+    if ((optind == argc) == !batch) {
         usage();
     }
 
-    for (i = optind; i < argc; i++) {
+    if (statepath && state_load(statepath)) {
+        exit(1);
+    }
+
+    if (records) {
+        printf("file\tresult\tzip64\tentries\tcd_offset\tcd_size\tmessage\n");
+    }
+
+    i = optind;
+    for (tstep = trace_now(); (filename = next_file(argc,argv,&i,batch))
+            != NULL; trace_fileno++, tstep = trace_now()) {
+        trace_span("next file",NULL,tstep);
+        tfile = tstep = trace_now();
         if (verbose) {
-            printf("Fixing %s:...",argv[i]);
+            printf("Fixing %s:...",filename);
         }
-        if (access(argv[i],W_OK)) {
+        if (access(filename,nopatch?R_OK:W_OK)) {
             err=errno;
             if (verbose) {
                 printf("Failed!\n");
                 fflush(stdout);
             }
-            fprintf(stderr,"Failed to fix %s: %s\n",argv[i],strerror(err));
+            fprintf(stderr,"Failed to fix %s: %s\n",filename,strerror(err));
             fflush(stderr);
+            if (records) {
+                print_record(filename,-1,strerror(err),flags);
+            }
             problems++;
+            trace_span("stat",NULL,tstep);
+            trace_span("file",filename,tfile);
             continue;
         }
 
-        if ((res = fixup(argv[i],&errmsg,nopatch)) < 0) {
+        /* A file we have already examined and which hasn't changed since
+           gets the same answer as last time.  Like fixup(), this doesn't
+           follow symbolic links, so a link and its target aren't confused */
+        known = (lstat(filename,&sbuf) == 0);
+        trace_span("stat",NULL,tstep);
+        tstep = trace_now();
+        if (known && (sf = seen_lookup(&sbuf)) != NULL) {
+            res = sf->res;
+            errmsg = sf->msg ? sf->msg : "";
+        } else if (known && statepath &&
+                (st = state_lookup(&sbuf,flags)) != NULL) {
+            /* Unchanged since an earlier run */
+            res = st->res;
+            errmsg = st->msg;
+            seen_add(&sbuf,res,errmsg);
+        } else {
+            res = fixup(filename,&errmsg,flags);
+            trace_span("fixup",NULL,tstep);
+            tstep = trace_now();
+
+            /* Don't remember files we've just changed: their times will
+               differ next time we see them anyway */
+            if (known && (res != 1 || nopatch)) {
+                seen_add(&sbuf,res,errmsg);
+            }
+
+            /* For later runs, remember files needing nothing, and files
+               we've fixed as they now are.  Failures are tried again, as
+               they may have been transient */
+            if (statepath && known && res >= 0 && (res == 0 || !nopatch) &&
+                    (res == 0 || stat(filename,&sbuf) == 0) &&
+                    state_add(&sbuf,flags,0,res == 0 ? errmsg :
+                    "Already fixed")) {
+                fprintf(stderr,"Out of memory\n");
+                exit(1);
+            }
+        }
+
+        if ((fixres = res) < 0) {
             problems++;
         }
 
         if (verbose) {
             if (res == 1) {
-                printf("Success!%s\n",nopatch?" (dryrun: no change made)":"");
+                printf("Success!%s%s%s\n",*errmsg?" ":"",errmsg,
+                        nopatch?" (dryrun: no change made)":"");
             } else if (res == 0) {
                 printf("Unnecessary: %s\n",errmsg);
             } else {
@@ -272,6 +3512,72 @@ int main (int argc, char **argv)
             fflush(stdout);
             fflush(stderr);
         }
+        trace_span("report",NULL,tstep);
+
+        /* Then any central directory repairs asked for.  Missing
+           end records come first as we can't find the directory without
+           them, and offsets come before sizes as finding truncated sizes
+           depends on them */
+        if (z64 && res >= 0 && (res = run_step(fixz64,
+                "Adding Zip64 end records to",filename,flags,verbose)) < 0) {
+            problems++;
+        }
+        if (offsets && res >= 0 && (res = run_step(fixoffsets,
+                "Repairing offsets in",filename,flags,verbose)) < 0) {
+            problems++;
+        }
+        if (sizes && res >= 0 && (res = run_step(fixsizes,
+                "Repairing sizes in",filename,flags,verbose)) < 0) {
+            problems++;
+        }
+
+        if ((nrename_rules || rename_backslashes) && res >= 0 &&
+                (res = run_step(fixnames,"Renaming entries in",filename,flags,
+                verbose)) < 0) {
+            problems++;
+        }
+        if (strip && res >= 0 && (res = run_step(fixextras,
+                "Removing extra fields from",filename,flags,verbose)) < 0) {
+            problems++;
+        }
+        if (descriptors && res >= 0 && (res = run_step(fixdescriptors,
+                "Repairing data descriptors in",filename,flags,verbose)) < 0) {
+            problems++;
+        }
+
+        /* The record describes the central directory as the steps above
+           have left it */
+        if (records) {
+            print_record(filename,fixres,errmsg,flags);
+        }
+
+        /* If asked, check the (possibly just fixed) central directory */
+        if (check && res >= 0 &&
+                run_step(checkcd,"Checking",filename,flags,verbose) < 0) {
+            problems++;
+        }
+
+        /* Lookups are always reported, as they are what was asked for */
+        if (lookup_name && res >= 0 && run_step(findentry,"Looking up entry in",
+                filename,flags,1) < 0) {
+            problems++;
+        }
+        trace_span("file",filename,tfile);
+    }
+
+    if (verbose > 1) {
+        printf("Seen cache: %lu hits, %lu misses\n",seen_hits,seen_misses);
+        if (statepath) {
+            printf("State: %lu files unchanged since last run\n",state_hits);
+        }
+    }
+
+    if (statepath && state_save(statepath)) {
+        problems++;
+    }
+
+    if (trace_path && trace_write()) {
+        problems++;
     }
 
     if (problems) {